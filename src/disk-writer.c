@@ -0,0 +1,578 @@
+/*
+ *      disk-writer.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk-writer.h"
+
+#include "transfer-engine.h"
+
+G_DEFINE_TYPE (DiskWriter, disk_writer, G_TYPE_OBJECT)
+
+struct _DiskFile {
+    gint fd;
+    volatile gint refs;
+    volatile gint error;
+
+    RangeJournal *journal;
+    volatile gint complete;
+
+    // Set while an allocation is queued, guarded by the writer lock
+    gboolean allocating;
+
+    // Written since the last sync, only used by the writer thread
+    gboolean dirty;
+};
+
+struct _DiskStream {
+    DiskWriter *writer;
+    DiskFile *file;
+    CURL *curl;
+
+    // Buffer being filled and the file offset of its first byte
+    gchar *buff;
+    gsize len;
+    goffset offset;
+
+    // Waiting in the writer to be resumed, guarded by the writer lock
+    gboolean waiting;
+};
+
+typedef struct _WriteJob WriteJob;
+struct _WriteJob {
+    DiskStream *stream;
+
+    gchar *buff;
+    gsize len;
+    goffset offset;
+
+    // Last job of the stream, it is freed once this is written
+    gboolean close;
+
+    // Reserve size bytes for this file instead of writing
+    DiskFile *allocate;
+    goffset size;
+
+    // Report on this file once the jobs queued before are done
+    DiskFile *finish;
+    gboolean complete;
+
+    // Result of an allocation or a finish
+    DiskFileDoneFunc done;
+    gpointer user_data;
+};
+
+struct _DiskWriterPrivate {
+    GThread *thread;
+    GAsyncQueue *jobs;
+
+    GMutex *lock;
+    GSList *pool;
+    GSList *waiting;
+    gsize queued;
+
+    // Files with writes not yet synced and journaled, writer thread only
+    GSList *dirty;
+    time_t synced;
+};
+
+static DiskWriter *instance = NULL;
+
+static gpointer disk_writer_main (DiskWriter *self);
+
+static void
+disk_writer_finalize (GObject *object)
+{
+    DiskWriter *self = DISK_WRITER (object);
+
+    disk_writer_shutdown (self);
+
+    g_slist_foreach (self->priv->pool, (GFunc) free, NULL);
+    g_slist_free (self->priv->pool);
+
+    g_async_queue_unref (self->priv->jobs);
+    g_mutex_free (self->priv->lock);
+
+    G_OBJECT_CLASS (disk_writer_parent_class)->finalize (object);
+}
+
+static void
+disk_writer_class_init (DiskWriterClass *klass)
+{
+    GObjectClass *object_class;
+    object_class = G_OBJECT_CLASS (klass);
+
+    g_type_class_add_private ((gpointer) klass, sizeof (DiskWriterPrivate));
+
+    object_class->finalize = disk_writer_finalize;
+}
+
+static void
+disk_writer_init (DiskWriter *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), DISK_WRITER_TYPE, DiskWriterPrivate);
+
+    self->priv->jobs = g_async_queue_new ();
+    self->priv->lock = g_mutex_new ();
+    self->priv->pool = NULL;
+    self->priv->waiting = NULL;
+    self->priv->queued = 0;
+    self->priv->dirty = NULL;
+    self->priv->synced = time (NULL);
+
+    self->priv->thread = g_thread_create ((GThreadFunc) disk_writer_main,
+        self, TRUE, NULL);
+}
+
+DiskWriter*
+disk_writer_get_default (void)
+{
+    static gsize once = 0;
+
+    // Files are opened from the engine thread as well as the main loop
+    if (g_once_init_enter (&once)) {
+        instance = g_object_new (DISK_WRITER_TYPE, NULL);
+        g_once_init_leave (&once, 1);
+    }
+
+    return instance;
+}
+
+void
+disk_writer_shutdown (DiskWriter *self)
+{
+    if (!self->priv->thread) {
+        return;
+    }
+
+    // An empty job tells the writer thread to stop once the queue is drained
+    g_async_queue_push (self->priv->jobs, g_new0 (WriteJob, 1));
+
+    g_thread_join (self->priv->thread);
+    self->priv->thread = NULL;
+}
+
+static gchar*
+disk_writer_alloc (DiskWriter *self)
+{
+    gpointer buff = NULL;
+
+    g_mutex_lock (self->priv->lock);
+    if (self->priv->pool) {
+        buff = self->priv->pool->data;
+        self->priv->pool = g_slist_delete_link (self->priv->pool, self->priv->pool);
+    }
+    g_mutex_unlock (self->priv->lock);
+
+    if (!buff && posix_memalign (&buff, DISK_WRITER_ALIGN, DISK_WRITER_BUFFER_SIZE) != 0) {
+        g_error ("Unable to allocate write buffer");
+    }
+
+    return buff;
+}
+
+DiskFile*
+disk_file_new (gint fd)
+{
+    DiskFile *file = g_new0 (DiskFile, 1);
+
+    file->fd = fd;
+    file->refs = 1;
+    file->error = 0;
+
+    return file;
+}
+
+DiskFile*
+disk_file_ref (DiskFile *file)
+{
+    g_atomic_int_inc (&file->refs);
+    return file;
+}
+
+void
+disk_file_unref (DiskFile *file)
+{
+    if (g_atomic_int_dec_and_test (&file->refs)) {
+        close (file->fd);
+
+        if (file->journal && file->complete && !file->error) {
+            range_journal_discard (file->journal);
+        } else if (file->journal) {
+            range_journal_free (file->journal);
+        }
+
+        g_free (file);
+    }
+}
+
+gboolean
+disk_file_has_error (DiskFile *file)
+{
+    return g_atomic_int_get (&file->error);
+}
+
+void
+disk_file_set_journal (DiskFile *file, RangeJournal *journal)
+{
+    file->journal = journal;
+}
+
+void
+disk_file_finish (DiskFile *file, gboolean complete,
+    DiskFileDoneFunc done, gpointer user_data)
+{
+    DiskWriter *writer = disk_writer_get_default ();
+    WriteJob *job = g_new0 (WriteJob, 1);
+
+    job->finish = disk_file_ref (file);
+    job->complete = complete;
+    job->done = done;
+    job->user_data = user_data;
+
+    g_async_queue_push (writer->priv->jobs, job);
+}
+
+void
+disk_file_allocate (DiskFile *file, goffset size,
+    DiskFileDoneFunc done, gpointer user_data)
+{
+    DiskWriter *writer = disk_writer_get_default ();
+    WriteJob *job = g_new0 (WriteJob, 1);
+
+    // Writes wait for the result so they land in the reserved space
+    job->allocate = disk_file_ref (file);
+    job->size = size;
+    job->done = done;
+    job->user_data = user_data;
+
+    g_mutex_lock (writer->priv->lock);
+    file->allocating = TRUE;
+    g_mutex_unlock (writer->priv->lock);
+
+    g_async_queue_push (writer->priv->jobs, job);
+}
+
+DiskStream*
+disk_stream_new (DiskFile *file, goffset offset, CURL *curl)
+{
+    DiskStream *stream = g_new0 (DiskStream, 1);
+
+    stream->writer = disk_writer_get_default ();
+    stream->file = disk_file_ref (file);
+    stream->curl = curl;
+    stream->offset = offset;
+
+    return stream;
+}
+
+static void
+disk_stream_submit (DiskStream *stream, gboolean close)
+{
+    DiskWriterPrivate *priv = stream->writer->priv;
+    WriteJob *job = g_new0 (WriteJob, 1);
+
+    job->stream = stream;
+    job->buff = stream->buff;
+    job->len = stream->len;
+    job->offset = stream->offset;
+    job->close = close;
+
+    stream->offset += stream->len;
+    stream->buff = NULL;
+    stream->len = 0;
+
+    g_mutex_lock (priv->lock);
+    priv->queued += job->len;
+    g_mutex_unlock (priv->lock);
+
+    g_async_queue_push (priv->jobs, job);
+}
+
+gint
+disk_stream_write (DiskStream *stream, const gchar *data, gsize len)
+{
+    DiskWriterPrivate *priv = stream->writer->priv;
+
+    if (disk_file_has_error (stream->file)) {
+        return DISK_STREAM_ERROR;
+    }
+
+    g_mutex_lock (priv->lock);
+    if (priv->queued >= DISK_WRITER_MAX_QUEUED || stream->file->allocating) {
+        if (!stream->waiting) {
+            stream->waiting = TRUE;
+            priv->waiting = g_slist_prepend (priv->waiting, stream);
+        }
+
+        g_mutex_unlock (priv->lock);
+        return DISK_STREAM_FULL;
+    }
+    g_mutex_unlock (priv->lock);
+
+    while (len > 0) {
+        if (!stream->buff) {
+            stream->buff = disk_writer_alloc (stream->writer);
+            stream->len = 0;
+        }
+
+        gsize n = MIN (len, DISK_WRITER_BUFFER_SIZE - stream->len);
+        memcpy (stream->buff + stream->len, data, n);
+
+        stream->len += n;
+        data += n;
+        len -= n;
+
+        if (stream->len == DISK_WRITER_BUFFER_SIZE) {
+            disk_stream_submit (stream, FALSE);
+        }
+    }
+
+    return DISK_STREAM_OK;
+}
+
+void
+disk_stream_close (DiskStream *stream)
+{
+    DiskWriterPrivate *priv = stream->writer->priv;
+
+    g_mutex_lock (priv->lock);
+    if (stream->waiting) {
+        stream->waiting = FALSE;
+        priv->waiting = g_slist_remove (priv->waiting, stream);
+    }
+    g_mutex_unlock (priv->lock);
+
+    disk_stream_submit (stream, TRUE);
+}
+
+static void
+disk_writer_write_job (DiskWriter *self, WriteJob *job)
+{
+    DiskFile *file = job->stream->file;
+    gsize done = 0;
+
+    while (done < job->len && !disk_file_has_error (file)) {
+        gssize n = pwrite (file->fd, job->buff + done, job->len - done, job->offset + done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            g_print ("Error writing download data: %s\n", g_strerror (errno));
+            g_atomic_int_set (&file->error, TRUE);
+            break;
+        }
+
+        done += n;
+    }
+
+    if (done == job->len && job->len > 0 && file->journal) {
+        range_journal_add (file->journal, job->offset, job->offset + job->len);
+
+        if (!file->dirty) {
+            file->dirty = TRUE;
+            self->priv->dirty = g_slist_prepend (self->priv->dirty, disk_file_ref (file));
+        }
+    }
+}
+
+static void
+disk_writer_allocate_job (DiskWriter *self, WriteJob *job)
+{
+    DiskFile *file = job->allocate;
+    gint err = 0;
+
+    // Not posix_fallocate, glibc emulates it by writing every block when
+    // the filesystem cannot reserve space, which crawls over NFS
+    while (fallocate (file->fd, 0, 0, job->size) != 0) {
+        err = errno;
+        if (err != EINTR) {
+            break;
+        }
+        err = 0;
+    }
+
+    // Filesystems that cannot reserve space still get the final length
+    if (err == EOPNOTSUPP || err == ENOSYS || err == EINVAL) {
+        err = ftruncate (file->fd, job->size) == 0 ? 0 : errno;
+    }
+
+    if (err != 0) {
+        g_print ("Error allocating download file: %s\n", g_strerror (err));
+        g_atomic_int_set (&file->error, TRUE);
+    }
+
+    if (job->done) {
+        job->done (err == 0, job->user_data);
+    }
+}
+
+// Continue every stream waiting for the writer, called with the lock held
+static void
+disk_writer_resume_waiting (DiskWriter *self)
+{
+    DiskWriterPrivate *priv = self->priv;
+    GSList *iter;
+
+    for (iter = priv->waiting; iter; iter = iter->next) {
+        ((DiskStream*) iter->data)->waiting = FALSE;
+        transfer_engine_resume (transfer_engine_get_default (),
+            ((DiskStream*) iter->data)->curl);
+    }
+
+    g_slist_free (priv->waiting);
+    priv->waiting = NULL;
+}
+
+static void
+disk_writer_finish_job (DiskWriter *self, WriteJob *job)
+{
+    DiskFile *file = job->finish;
+
+    // Every write of the file came before this job, only a synced file
+    // counts as done
+    if (!disk_file_has_error (file) && fdatasync (file->fd) != 0) {
+        g_print ("Error syncing download data: %s\n", g_strerror (errno));
+        g_atomic_int_set (&file->error, TRUE);
+    }
+
+    gboolean ok = !disk_file_has_error (file);
+
+    if (ok && job->complete) {
+        g_atomic_int_set (&file->complete, TRUE);
+    }
+
+    if (job->done) {
+        job->done (ok, job->user_data);
+    }
+}
+
+static void
+disk_writer_sync (DiskWriter *self)
+{
+    DiskWriterPrivate *priv = self->priv;
+    GSList *iter;
+
+    // Data must reach the disk before the journal claims it is there
+    for (iter = priv->dirty; iter; iter = iter->next) {
+        DiskFile *file = iter->data;
+
+        // A complete file was synced when it finished and drops its journal
+        if (!g_atomic_int_get (&file->complete)) {
+            if (fdatasync (file->fd) == 0) {
+                range_journal_commit (file->journal);
+            } else {
+                g_print ("Error syncing download data: %s\n", g_strerror (errno));
+            }
+        }
+
+        file->dirty = FALSE;
+        disk_file_unref (file);
+    }
+
+    g_slist_free (priv->dirty);
+    priv->dirty = NULL;
+    priv->synced = time (NULL);
+}
+
+static gpointer
+disk_writer_main (DiskWriter *self)
+{
+    DiskWriterPrivate *priv = self->priv;
+    WriteJob *job;
+
+    while (TRUE) {
+        GTimeVal tv;
+
+        g_get_current_time (&tv);
+        g_time_val_add (&tv, DISK_WRITER_SYNC_INTERVAL * G_USEC_PER_SEC);
+
+        job = g_async_queue_timed_pop (priv->jobs, &tv);
+        if (!job) {
+            disk_writer_sync (self);
+            continue;
+        } else if (job->allocate) {
+            disk_writer_allocate_job (self, job);
+
+            // Streams held back by the allocation try again, those still
+            // over the backlog limit go back to waiting
+            g_mutex_lock (priv->lock);
+            job->allocate->allocating = FALSE;
+            disk_writer_resume_waiting (self);
+            g_mutex_unlock (priv->lock);
+
+            disk_file_unref (job->allocate);
+            g_free (job);
+            continue;
+        } else if (job->finish) {
+            disk_writer_finish_job (self, job);
+            disk_file_unref (job->finish);
+            g_free (job);
+            continue;
+        } else if (!job->stream) {
+            break;
+        }
+
+        if (job->buff) {
+            disk_writer_write_job (self, job);
+        }
+
+        g_mutex_lock (priv->lock);
+
+        if (job->buff) {
+            priv->pool = g_slist_prepend (priv->pool, job->buff);
+        }
+
+        priv->queued -= job->len;
+
+        if (priv->queued <= DISK_WRITER_MAX_QUEUED / 2) {
+            disk_writer_resume_waiting (self);
+        }
+
+        g_mutex_unlock (priv->lock);
+
+        // A finished stream is journaled right away, otherwise batch the
+        // syncs so they do not stall the writes
+        if (job->close || time (NULL) - priv->synced >= DISK_WRITER_SYNC_INTERVAL) {
+            disk_writer_sync (self);
+        }
+
+        if (job->close) {
+            disk_file_unref (job->stream->file);
+            g_free (job->stream);
+        }
+
+        g_free (job);
+    }
+
+    disk_writer_sync (self);
+    g_free (job);
+
+    return NULL;
+}
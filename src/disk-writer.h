@@ -0,0 +1,130 @@
+/*
+ *      disk-writer.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#ifndef __DISK_WRITER_H__
+#define __DISK_WRITER_H__
+
+#include <glib-object.h>
+
+#include <curl/curl.h>
+
+#include "range-journal.h"
+
+#define DISK_WRITER_TYPE (disk_writer_get_type ())
+#define DISK_WRITER(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), DISK_WRITER_TYPE, DiskWriter))
+#define DISK_WRITER_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), DISK_WRITER_TYPE, DiskWriterClass))
+#define IS_DISK_WRITER(object) (G_TYPE_CHECK_INSTANCE_TYPE ((object), DISK_WRITER_TYPE))
+#define IS_DISK_WRITER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), DISK_WRITER_TYPE))
+#define DISK_WRITER_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), DISK_WRITER_TYPE, DiskWriterClass))
+
+// Received data is gathered in buffers of this size before it is written
+#define DISK_WRITER_BUFFER_SIZE (1024 * 1024)
+#define DISK_WRITER_ALIGN 4096
+
+// Streams are paused once this much data waits for the disk and resumed
+// when the backlog has halved
+#define DISK_WRITER_MAX_QUEUED (64 * 1024 * 1024)
+
+// Written data is synced and recorded in the journals this often, seconds
+#define DISK_WRITER_SYNC_INTERVAL 2
+
+enum {
+    DISK_STREAM_OK = 0,
+    DISK_STREAM_FULL,
+    DISK_STREAM_ERROR,
+};
+
+G_BEGIN_DECLS
+
+typedef struct _DiskWriter DiskWriter;
+typedef struct _DiskWriterClass DiskWriterClass;
+typedef struct _DiskWriterPrivate DiskWriterPrivate;
+
+typedef struct _DiskFile DiskFile;
+typedef struct _DiskStream DiskStream;
+
+/*
+ * Called from the writer thread once an allocation, or everything queued
+ * for a file before disk_file_finish, is done. ok is FALSE when any of it
+ * failed.
+ */
+typedef void (*DiskFileDoneFunc) (gboolean ok, gpointer user_data);
+
+struct _DiskWriter {
+    GObject parent;
+
+    DiskWriterPrivate *priv;
+};
+
+struct _DiskWriterClass {
+    GObjectClass parent;
+};
+
+DiskWriter *disk_writer_get_default (void);
+void disk_writer_shutdown (DiskWriter *self);
+
+GType disk_writer_get_type (void);
+
+/*
+ * A DiskFile owns an open file descriptor shared by any number of streams,
+ * it is closed once the last reference is dropped and its data written.
+ */
+DiskFile *disk_file_new (gint fd);
+DiskFile *disk_file_ref (DiskFile *file);
+void disk_file_unref (DiskFile *file);
+gboolean disk_file_has_error (DiskFile *file);
+
+/*
+ * Record every range written to file in journal, which the file owns from
+ * then on. The journal is deleted with a file that finished complete.
+ */
+void disk_file_set_journal (DiskFile *file, RangeJournal *journal);
+
+/*
+ * Report through done once the streams of file, all closed before, are on
+ * disk. With complete set a file written and synced without error drops
+ * its journal, otherwise the journal keeps what was synced.
+ */
+void disk_file_finish (DiskFile *file, gboolean complete,
+    DiskFileDoneFunc done, gpointer user_data);
+
+/*
+ * Reserve size bytes for the file so later writes cannot run out of space.
+ * This happens on the writer thread, streams of the file report
+ * DISK_STREAM_FULL until it is done and are then resumed. done is called
+ * from the writer thread with the result, a failure such as ENOSPC also
+ * marks the file as having an error.
+ */
+void disk_file_allocate (DiskFile *file, goffset size,
+    DiskFileDoneFunc done, gpointer user_data);
+
+/*
+ * A DiskStream writes sequentially into file starting at offset. curl is
+ * the transfer feeding the stream, it is resumed through the transfer
+ * engine after disk_stream_write returned DISK_STREAM_FULL.
+ */
+DiskStream *disk_stream_new (DiskFile *file, goffset offset, CURL *curl);
+gint disk_stream_write (DiskStream *stream, const gchar *data, gsize len);
+void disk_stream_close (DiskStream *stream);
+
+G_END_DECLS
+
+#endif /* __DISK_WRITER_H__ */
@@ -25,31 +25,380 @@
 #include "download-group.h"
 
 #include "download.h"
+#include "download-registry.h"
+#include "transfer-engine.h"
 
 G_DEFINE_TYPE (DownloadGroup, download_group, G_TYPE_OBJECT)
 
+typedef struct _GroupEntry GroupEntry;
+typedef struct _HostQueue HostQueue;
+
+struct _GroupEntry {
+    Download *download;
+    gulong handler, resolved_handler;
+    HostQueue *host;
+
+    gint priority;
+    guint64 serial;
+
+    // Position in the host's ready queue, NULL unless waiting for a slot
+    GSequenceIter *ready;
+    gboolean active;
+
+    // Position in the entries waiting for a resolver, set while resolving
+    GSequenceIter *unresolved;
+    gboolean resolving;
+};
+
+struct _HostQueue {
+    gchar *name;
+
+    // QUEUED entries ordered by priority, then by the order they were queued
+    GSequence *ready;
+    gint active;
+
+    // Set while the host serves its downloads as HTTP/2 streams
+    gboolean multiplex;
+
+    // Position in the eligible hosts, NULL when nothing is waiting or the
+    // host has no free connection
+    GSequenceIter *eligible;
+};
+
 struct _DownloadGroupPrivate {
     GPtrArray *downloads;
     gint state;
     gchar *name;
+
+    GMutex *lock;
+
+    // Download* -> GroupEntry for every download in the group
+    GHashTable *entries;
+
+    // Host name -> HostQueue
+    GHashTable *hosts;
+
+    // Hosts that can take another download, ordered by their best entry
+    GSequence *eligible;
+    guint64 serial;
+
+    // Group slots in use, a multiplexing host takes one for all its streams
+    gint active, max_active, max_per_host, max_streams;
+
+    // QUEUED entries with pages to scrape, resolved ahead of their start by
+    // a pool of their own so the slots only ever move file data
+    GSequence *unresolved;
+    gint resolving, max_resolving;
+
+    // Parent of the rate bucket of every download in the group
+    RateBucket *bucket;
 };
 
+static gint
+entry_compare (GroupEntry *a, GroupEntry *b, gpointer data)
+{
+    if (a->priority != b->priority) {
+        return a->priority > b->priority ? -1 : 1;
+    }
+
+    return a->serial < b->serial ? -1 : (a->serial > b->serial ? 1 : 0);
+}
+
+static GroupEntry*
+host_queue_head (HostQueue *h)
+{
+    return g_sequence_get (g_sequence_get_begin_iter (h->ready));
+}
+
+static gint
+host_compare (HostQueue *a, HostQueue *b, gpointer data)
+{
+    return entry_compare (host_queue_head (a), host_queue_head (b), NULL);
+}
+
 static void
-on_state_changed (Download *down, gint state, DownloadGroup *self)
+host_queue_free (HostQueue *h)
+{
+    g_sequence_free (h->ready);
+    g_free (h->name);
+    g_free (h);
+}
+
+static HostQueue*
+download_group_get_host (DownloadGroup *self, const gchar *name)
+{
+    HostQueue *h;
+
+    if (!name) {
+        name = "";
+    }
+
+    h = g_hash_table_lookup (self->priv->hosts, name);
+    if (!h) {
+        h = g_new0 (HostQueue, 1);
+        h->name = g_strdup (name);
+        h->ready = g_sequence_new (NULL);
+
+        g_hash_table_insert (self->priv->hosts, h->name, h);
+    }
+
+    return h;
+}
+
+static gint
+host_queue_slots (HostQueue *h)
+{
+    if (h->multiplex) {
+        return h->active > 0 ? 1 : 0;
+    }
+
+    return h->active;
+}
+
+/*
+ * Put the host in or out of the eligible set after its ready queue or its
+ * connection count changed.
+ */
+static void
+download_group_update_host (DownloadGroup *self, HostQueue *h)
+{
+    gboolean multiplex = transfer_engine_is_multiplexed (transfer_engine_get_default (), h->name);
+
+    if (multiplex != h->multiplex) {
+        // Running downloads move between own connections and one shared
+        self->priv->active -= host_queue_slots (h);
+        h->multiplex = multiplex;
+        self->priv->active += host_queue_slots (h);
+    }
+
+    gboolean free_slot = h->multiplex ? h->active < self->priv->max_streams :
+        self->priv->max_per_host <= 0 || h->active < self->priv->max_per_host;
+
+    if (free_slot && g_sequence_get_length (h->ready) > 0) {
+        if (h->eligible) {
+            g_sequence_sort_changed (h->eligible, (GCompareDataFunc) host_compare, NULL);
+        } else {
+            h->eligible = g_sequence_insert_sorted (self->priv->eligible, h,
+                (GCompareDataFunc) host_compare, NULL);
+        }
+    } else if (h->eligible) {
+        g_sequence_remove (h->eligible);
+        h->eligible = NULL;
+    }
+}
+
+static void
+download_group_push_ready (DownloadGroup *self, GroupEntry *e)
+{
+    if (e->ready || e->active) {
+        return;
+    }
+
+    e->serial = self->priv->serial++;
+    e->ready = g_sequence_insert_sorted (e->host->ready, e,
+        (GCompareDataFunc) entry_compare, NULL);
+
+    if (!e->resolving && !e->unresolved && download_can_resolve (e->download)) {
+        e->unresolved = g_sequence_insert_sorted (self->priv->unresolved, e,
+            (GCompareDataFunc) entry_compare, NULL);
+    }
+
+    download_group_update_host (self, e->host);
+}
+
+static void
+download_group_release (DownloadGroup *self, GroupEntry *e)
+{
+    if (e->ready) {
+        g_sequence_remove (e->ready);
+        e->ready = NULL;
+    }
+
+    if (e->unresolved) {
+        g_sequence_remove (e->unresolved);
+        e->unresolved = NULL;
+    }
+
+    if (e->active) {
+        self->priv->active -= host_queue_slots (e->host);
+        e->active = FALSE;
+        e->host->active--;
+        self->priv->active += host_queue_slots (e->host);
+    }
+
+    download_group_update_host (self, e->host);
+}
+
+/*
+ * Best eligible host that can start another download: any of them while the
+ * group has free slots, otherwise only hosts adding a stream to their
+ * running HTTP/2 connection.
+ */
+static HostQueue*
+download_group_next_host (DownloadGroup *self)
+{
+    DownloadGroupPrivate *priv = self->priv;
+    GSequenceIter *iter = g_sequence_get_begin_iter (priv->eligible);
+
+    for (; !g_sequence_iter_is_end (iter); iter = g_sequence_iter_next (iter)) {
+        HostQueue *h = g_sequence_get (iter);
+
+        if (priv->active < priv->max_active || (h->multiplex && h->active > 0)) {
+            return h;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the best waiting entry of the best host that still has a free
+ * connection while the group has free slots. Must be called with the lock
+ * held, the returned downloads are started by the caller once it is
+ * released since starting emits state-changed.
+ */
+static GList*
+download_group_fill_slots (DownloadGroup *self)
+{
+    DownloadGroupPrivate *priv = self->priv;
+    GList *start = NULL;
+    HostQueue *h;
+
+    while ((h = download_group_next_host (self))) {
+        GSequenceIter *iter = g_sequence_get_begin_iter (h->ready);
+        GroupEntry *e = g_sequence_get (iter);
+
+        g_sequence_remove (iter);
+        e->ready = NULL;
+
+        // Starting resolves whatever the resolvers did not get to
+        if (e->unresolved) {
+            g_sequence_remove (e->unresolved);
+            e->unresolved = NULL;
+        }
+
+        if (download_get_state (e->download) == DOWNLOAD_STATE_QUEUED) {
+            priv->active -= host_queue_slots (h);
+            e->active = TRUE;
+            h->active++;
+            priv->active += host_queue_slots (h);
+
+            start = g_list_prepend (start, g_object_ref (e->download));
+        }
+
+        download_group_update_host (self, h);
+    }
+
+    return g_list_reverse (start);
+}
+
+/*
+ * Hand the best unresolved entries to the free resolvers, called with the
+ * lock held like download_group_fill_slots.
+ */
+static GList*
+download_group_fill_resolvers (DownloadGroup *self)
 {
-    if (state != DOWNLOAD_STATE_QUEUED && state != DOWNLOAD_STATE_RUNNING) {
-        gint i;
-        for (i = 0; i < self->priv->downloads->len; i++) {
-            Download *d = DOWNLOAD (self->priv->downloads->pdata[i]);
-            g_print ("SC State: %d\n", download_get_state (d));
-            if (down == d) continue;
-            if (download_get_state (d) == DOWNLOAD_STATE_QUEUED) {
-                download_start (d);
-                g_print ("State Changed Start\n");
-                return;
+    DownloadGroupPrivate *priv = self->priv;
+    GList *resolve = NULL;
+
+    while (priv->resolving < priv->max_resolving && g_sequence_get_length (priv->unresolved) > 0) {
+        GSequenceIter *iter = g_sequence_get_begin_iter (priv->unresolved);
+        GroupEntry *e = g_sequence_get (iter);
+
+        g_sequence_remove (iter);
+        e->unresolved = NULL;
+
+        if (download_get_state (e->download) == DOWNLOAD_STATE_QUEUED && !e->active) {
+            e->resolving = TRUE;
+            priv->resolving++;
+
+            resolve = g_list_prepend (resolve, g_object_ref (e->download));
+        }
+    }
+
+    return g_list_reverse (resolve);
+}
+
+static void
+download_group_resolve_done (DownloadGroup *self, Download *d)
+{
+    g_mutex_lock (self->priv->lock);
+
+    GroupEntry *e = g_hash_table_lookup (self->priv->entries, d);
+    if (e && e->resolving) {
+        e->resolving = FALSE;
+        self->priv->resolving--;
+    }
+
+    g_mutex_unlock (self->priv->lock);
+}
+
+static void
+download_group_start_list (DownloadGroup *self, GList *start)
+{
+    GList *iter, *resolve;
+
+    for (iter = start; iter; iter = iter->next) {
+        download_start (DOWNLOAD (iter->data));
+        g_object_unref (iter->data);
+    }
+
+    g_list_free (start);
+
+    // Resolvers are filled after the slots, an entry just started does
+    // not need one any more
+    for (;;) {
+        g_mutex_lock (self->priv->lock);
+        resolve = download_group_fill_resolvers (self);
+        g_mutex_unlock (self->priv->lock);
+
+        if (!resolve) {
+            break;
+        }
+
+        for (iter = resolve; iter; iter = iter->next) {
+            if (!download_resolve (DOWNLOAD (iter->data))) {
+                download_group_resolve_done (self, iter->data);
             }
+            g_object_unref (iter->data);
         }
+
+        g_list_free (resolve);
+    }
+}
+
+static void
+on_resolved (Download *down, gboolean ok, DownloadGroup *self)
+{
+    download_group_resolve_done (self, down);
+    download_group_start_list (self, NULL);
+}
+
+static void
+on_state_changed (Download *down, gint state, DownloadGroup *self)
+{
+    GList *start = NULL;
+
+    g_mutex_lock (self->priv->lock);
+
+    GroupEntry *e = g_hash_table_lookup (self->priv->entries, down);
+    if (!e) {
+        g_mutex_unlock (self->priv->lock);
+        return;
     }
+
+    if (state == DOWNLOAD_STATE_QUEUED) {
+        download_group_push_ready (self, e);
+    } else if (state != DOWNLOAD_STATE_RUNNING && e->active) {
+        download_group_release (self, e);
+    }
+
+    start = download_group_fill_slots (self);
+
+    g_mutex_unlock (self->priv->lock);
+
+    download_group_start_list (self, start);
 }
 
 static void
@@ -77,6 +426,24 @@ download_group_init (DownloadGroup *self)
     self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), DOWNLOAD_GROUP_TYPE, DownloadGroupPrivate);
 
     self->priv->downloads = g_ptr_array_new ();
+
+    self->priv->lock = g_mutex_new ();
+    self->priv->entries = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+    self->priv->hosts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+        (GDestroyNotify) host_queue_free);
+    self->priv->eligible = g_sequence_new (NULL);
+
+    self->priv->active = 0;
+    self->priv->max_active = DOWNLOAD_GROUP_DEFAULT_MAX_ACTIVE;
+    self->priv->max_per_host = DOWNLOAD_GROUP_DEFAULT_MAX_PER_HOST;
+    self->priv->max_streams = DOWNLOAD_GROUP_DEFAULT_MAX_STREAMS;
+
+    self->priv->unresolved = g_sequence_new (NULL);
+    self->priv->resolving = 0;
+    self->priv->max_resolving = DOWNLOAD_GROUP_DEFAULT_MAX_RESOLVING;
+
+    RateLimiter *limiter = rate_limiter_get_default ();
+    self->priv->bucket = rate_limiter_bucket_new (limiter, rate_limiter_get_global (limiter));
 }
 
 DownloadGroup*
@@ -89,52 +456,210 @@ download_group_new (const gchar *name)
     return self;
 }
 
-void
-download_group_add (DownloadGroup *self, Download *d)
+static GroupEntry*
+download_group_add_locked (DownloadGroup *self, Download *d, const gchar *host)
 {
+    GroupEntry *e = g_hash_table_lookup (self->priv->entries, d);
+
+    if (e) {
+        return e;
+    }
+
+    e = g_new0 (GroupEntry, 1);
+    e->download = d;
+    e->host = download_group_get_host (self, host);
+
     g_ptr_array_add (self->priv->downloads, d);
     g_object_ref (d);
 
-    g_signal_connect (d, "state-changed", G_CALLBACK (on_state_changed), self);
+    g_hash_table_insert (self->priv->entries, d, e);
+
+    rate_limiter_attach (rate_limiter_get_default (), d, self->priv->bucket);
+
+    e->handler = g_signal_connect (d, "state-changed", G_CALLBACK (on_state_changed), self);
+    e->resolved_handler = g_signal_connect (d, "resolved", G_CALLBACK (on_resolved), self);
+
+    return e;
+}
+
+void
+download_group_add (DownloadGroup *self, Download *d, const gchar *host)
+{
+    g_mutex_lock (self->priv->lock);
+    download_group_add_locked (self, d, host);
+    g_mutex_unlock (self->priv->lock);
 }
 
 void
 download_group_remove (DownloadGroup *self, Download *d)
 {
+    GList *start = NULL;
+
+    // The slot is handed on by the state change once the download stopped,
+    // not while its transfer still runs
+    if (download_get_state (d) == DOWNLOAD_STATE_RUNNING) {
+        download_pause (d);
+    }
+
+    g_mutex_lock (self->priv->lock);
+
+    GroupEntry *e = g_hash_table_lookup (self->priv->entries, d);
+    if (e) {
+        g_signal_handler_disconnect (d, e->handler);
+        g_signal_handler_disconnect (d, e->resolved_handler);
+        download_group_release (self, e);
+
+        if (e->resolving) {
+            self->priv->resolving--;
+        }
+
+        rate_limiter_detach (rate_limiter_get_default (), d);
+
+        g_hash_table_remove (self->priv->entries, d);
+        start = download_group_fill_slots (self);
+    }
+
     if (g_ptr_array_remove (self->priv->downloads, d)) {
         g_object_unref (d);
     }
+
+    g_mutex_unlock (self->priv->lock);
+
+    download_group_start_list (self, start);
 }
 
 void
 download_group_queue (DownloadGroup *self, Download *d)
 {
+    GList *start = NULL;
+
+    // Keyed like the batch adds, the per host limit applies to it as well
+    gchar *host = download_registry_get_host (download_registry_get_default (),
+        download_get_source (d));
+
+    g_mutex_lock (self->priv->lock);
+
+    GroupEntry *e = download_group_add_locked (self, d, host);
+
+    if (download_get_state (d) == DOWNLOAD_STATE_QUEUED) {
+        download_group_push_ready (self, e);
+        start = download_group_fill_slots (self);
+    }
+
+    g_mutex_unlock (self->priv->lock);
+
+    g_free (host);
+
+    download_group_start_list (self, start);
+}
+
+/*
+ * Add and queue a whole batch, hosts holds the host of each download. The
+ * free slots are filled once for the batch instead of once per download.
+ */
+void
+download_group_queue_all (DownloadGroup *self, GPtrArray *downloads, GPtrArray *hosts)
+{
+    GList *start = NULL;
     gint i;
-    gboolean found = FALSE;
 
-    for (i = 0; i < self->priv->downloads->len; i++) {
-        if (self->priv->downloads->pdata[i] == d) {
-            found = TRUE;
-            break;
+    g_mutex_lock (self->priv->lock);
+
+    for (i = 0; i < downloads->len; i++) {
+        Download *d = downloads->pdata[i];
+        GroupEntry *e = download_group_add_locked (self, d, hosts->pdata[i]);
+
+        if (download_get_state (d) == DOWNLOAD_STATE_QUEUED) {
+            download_group_push_ready (self, e);
         }
     }
 
-    if (!found) {
-        download_group_add (self, d);
-    }
+    start = download_group_fill_slots (self);
 
-    if (download_get_state (d) != DOWNLOAD_STATE_QUEUED) {
-        return;
-    }
+    g_mutex_unlock (self->priv->lock);
+
+    download_group_start_list (self, start);
+}
 
-    for (i = 0; i < self->priv->downloads->len; i++) {
-        if (d == self->priv->downloads->pdata[i]) continue;
-        gint state = download_get_state (DOWNLOAD (self->priv->downloads->pdata[i]));
-        if (state == DOWNLOAD_STATE_QUEUED || state == DOWNLOAD_STATE_RUNNING) {
-            download_queue (d);
-            return;
+void
+download_group_set_priority (DownloadGroup *self, Download *d, gint priority)
+{
+    g_mutex_lock (self->priv->lock);
+
+    GroupEntry *e = g_hash_table_lookup (self->priv->entries, d);
+    if (e) {
+        e->priority = priority;
+        if (e->ready) {
+            g_sequence_sort_changed (e->ready, (GCompareDataFunc) entry_compare, NULL);
+            download_group_update_host (self, e->host);
+        }
+
+        if (e->unresolved) {
+            g_sequence_sort_changed (e->unresolved, (GCompareDataFunc) entry_compare, NULL);
         }
     }
 
-    download_start (d);
+    g_mutex_unlock (self->priv->lock);
+}
+
+void
+download_group_set_max_active (DownloadGroup *self, gint max_active)
+{
+    GList *start = NULL;
+
+    g_mutex_lock (self->priv->lock);
+
+    self->priv->max_active = MAX (max_active, 1);
+    start = download_group_fill_slots (self);
+
+    g_mutex_unlock (self->priv->lock);
+
+    download_group_start_list (self, start);
+}
+
+gint
+download_group_get_max_active (DownloadGroup *self)
+{
+    return self->priv->max_active;
+}
+
+void
+download_group_set_max_per_host (DownloadGroup *self, gint max_per_host)
+{
+    GList *start = NULL;
+    GHashTableIter iter;
+    HostQueue *h;
+
+    g_mutex_lock (self->priv->lock);
+
+    self->priv->max_per_host = max_per_host;
+
+    g_hash_table_iter_init (&iter, self->priv->hosts);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &h)) {
+        download_group_update_host (self, h);
+    }
+
+    start = download_group_fill_slots (self);
+
+    g_mutex_unlock (self->priv->lock);
+
+    download_group_start_list (self, start);
+}
+
+gint
+download_group_get_max_per_host (DownloadGroup *self)
+{
+    return self->priv->max_per_host;
+}
+
+const gchar*
+download_group_get_name (DownloadGroup *self)
+{
+    return self->priv->name;
+}
+
+void
+download_group_set_rate_limit (DownloadGroup *self, guint64 rate)
+{
+    rate_limiter_set_rate (rate_limiter_get_default (), self->priv->bucket, rate);
 }
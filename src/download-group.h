@@ -25,6 +25,7 @@
 #include <glib-object.h>
 
 #include "download.h"
+#include "rate-limiter.h"
 
 #define DOWNLOAD_GROUP_TYPE (download_group_get_type ())
 #define DOWNLOAD_GROUP(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), DOWNLOAD_GROUP_TYPE, DownloadGroup))
@@ -33,6 +34,18 @@
 #define IS_DOWNLOAD_GROUP_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), DOWNLOAD_GROUP_TYPE))
 #define DOWNLOAD_GROUP_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), DOWNLOAD_GROUP_TYPE, DownloadGroupClass))
 
+#define DOWNLOAD_GROUP_DEFAULT_MAX_ACTIVE 8
+
+// Connections allowed to a single host, 0 means no limit
+#define DOWNLOAD_GROUP_DEFAULT_MAX_PER_HOST 4
+
+// Streams run at once on a host that multiplexes them over one HTTP/2
+// connection, that connection takes a single slot of the group
+#define DOWNLOAD_GROUP_DEFAULT_MAX_STREAMS 32
+
+// Queued downloads resolved at once ahead of getting a slot
+#define DOWNLOAD_GROUP_DEFAULT_MAX_RESOLVING 2
+
 G_BEGIN_DECLS
 
 typedef struct _DownloadGroup DownloadGroup;
@@ -51,10 +64,23 @@ struct _DownloadGroupClass {
 
 DownloadGroup *download_group_new (const gchar *name);
 
-void download_group_add (DownloadGroup *self, Download *d);
+void download_group_add (DownloadGroup *self, Download *d, const gchar *host);
 void download_group_remove (DownloadGroup *self, Download *d);
 
 void download_group_queue (DownloadGroup *self, Download *d);
+void download_group_queue_all (DownloadGroup *self, GPtrArray *downloads, GPtrArray *hosts);
+void download_group_set_priority (DownloadGroup *self, Download *d, gint priority);
+
+void download_group_set_max_active (DownloadGroup *self, gint max_active);
+gint download_group_get_max_active (DownloadGroup *self);
+
+void download_group_set_max_per_host (DownloadGroup *self, gint max_per_host);
+gint download_group_get_max_per_host (DownloadGroup *self);
+
+const gchar *download_group_get_name (DownloadGroup *self);
+
+// Bytes per second shared by the downloads of the group, 0 for no limit
+void download_group_set_rate_limit (DownloadGroup *self, guint64 rate);
 
 GType download_group_get_type (void);
 
@@ -0,0 +1,234 @@
+/*
+ *      download-registry.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "download-registry.h"
+
+G_DEFINE_TYPE (DownloadRegistry, download_registry, G_TYPE_OBJECT)
+
+typedef struct _DownloadType DownloadType;
+struct _DownloadType {
+    gchar *tag;
+    DownloadNewFunc create;
+    DownloadLoadFunc load;
+};
+
+struct _DownloadRegistryPrivate {
+    // tag -> DownloadType
+    GHashTable *types;
+
+    // scheme, host or .domain -> DownloadType
+    GHashTable *schemes;
+    GHashTable *hosts;
+    GHashTable *domains;
+};
+
+static DownloadRegistry *instance = NULL;
+
+static void
+download_type_free (DownloadType *type)
+{
+    g_free (type->tag);
+    g_free (type);
+}
+
+static void
+download_registry_finalize (GObject *object)
+{
+    DownloadRegistry *self = DOWNLOAD_REGISTRY (object);
+
+    g_hash_table_destroy (self->priv->schemes);
+    g_hash_table_destroy (self->priv->hosts);
+    g_hash_table_destroy (self->priv->domains);
+    g_hash_table_destroy (self->priv->types);
+
+    G_OBJECT_CLASS (download_registry_parent_class)->finalize (object);
+}
+
+static void
+download_registry_class_init (DownloadRegistryClass *klass)
+{
+    GObjectClass *object_class;
+    object_class = G_OBJECT_CLASS (klass);
+
+    g_type_class_add_private ((gpointer) klass, sizeof (DownloadRegistryPrivate));
+
+    object_class->finalize = download_registry_finalize;
+}
+
+static void
+download_registry_init (DownloadRegistry *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), DOWNLOAD_REGISTRY_TYPE, DownloadRegistryPrivate);
+
+    self->priv->types = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+        (GDestroyNotify) download_type_free);
+    self->priv->schemes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    self->priv->hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    self->priv->domains = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+DownloadRegistry*
+download_registry_get_default (void)
+{
+    static gsize once = 0;
+
+    // The loader thread reads saved downloads while the main loop adds new ones
+    if (g_once_init_enter (&once)) {
+        instance = g_object_new (DOWNLOAD_REGISTRY_TYPE, NULL);
+        g_once_init_leave (&once, 1);
+    }
+
+    return instance;
+}
+
+void
+download_registry_add_type (DownloadRegistry *self, const gchar *tag,
+    DownloadNewFunc create, DownloadLoadFunc load)
+{
+    DownloadType *type = g_new0 (DownloadType, 1);
+
+    type->tag = g_strdup (tag);
+    type->create = create;
+    type->load = load;
+
+    g_hash_table_replace (self->priv->types, type->tag, type);
+}
+
+void
+download_registry_add_types (DownloadRegistry *self, const DownloadRegisterFunc *types)
+{
+    for (; *types; types++) {
+        (*types) (self);
+    }
+}
+
+void
+download_registry_add_scheme (DownloadRegistry *self, const gchar *scheme, const gchar *tag)
+{
+    DownloadType *type = g_hash_table_lookup (self->priv->types, tag);
+
+    if (type) {
+        g_hash_table_replace (self->priv->schemes, g_ascii_strdown (scheme, -1), type);
+    }
+}
+
+void
+download_registry_add_host (DownloadRegistry *self, const gchar *pattern, const gchar *tag)
+{
+    DownloadType *type = g_hash_table_lookup (self->priv->types, tag);
+
+    if (!type) {
+        return;
+    }
+
+    if (pattern[0] == '.') {
+        g_hash_table_replace (self->priv->domains, g_ascii_strdown (pattern, -1), type);
+        g_hash_table_replace (self->priv->hosts, g_ascii_strdown (pattern + 1, -1), type);
+    } else {
+        g_hash_table_replace (self->priv->hosts, g_ascii_strdown (pattern, -1), type);
+    }
+}
+
+/*
+ * Returns the type claiming the scheme of url, with the start of the part
+ * after "://" in rest.
+ */
+static DownloadType*
+download_registry_get_scheme (DownloadRegistry *self, const gchar *url, const gchar **rest)
+{
+    const gchar *sep = url ? strstr (url, "://") : NULL;
+
+    if (!sep || sep == url) {
+        return NULL;
+    }
+
+    gchar *scheme = g_ascii_strdown (url, sep - url);
+    DownloadType *type = g_hash_table_lookup (self->priv->schemes, scheme);
+    g_free (scheme);
+
+    *rest = sep + 3;
+
+    return type;
+}
+
+gchar*
+download_registry_get_host (DownloadRegistry *self, const gchar *url)
+{
+    const gchar *rest;
+
+    if (!download_registry_get_scheme (self, url, &rest)) {
+        return NULL;
+    }
+
+    return g_ascii_strdown (rest, strcspn (rest, ":/?#"));
+}
+
+Download*
+download_registry_create (DownloadRegistry *self, const gchar *url,
+    const gchar *dest, const gchar *host)
+{
+    const gchar *rest, *dot;
+
+    DownloadType *type = download_registry_get_scheme (self, url, &rest);
+    if (!type) {
+        return NULL;
+    }
+
+    if (host) {
+        DownloadType *match = g_hash_table_lookup (self->priv->hosts, host);
+
+        // One lookup per label, longest domain first
+        for (dot = strchr (host, '.'); !match && dot; dot = strchr (dot + 1, '.')) {
+            match = g_hash_table_lookup (self->priv->domains, dot);
+        }
+
+        if (match) {
+            type = match;
+        }
+    }
+
+    return type->create (url, dest);
+}
+
+static DownloadType*
+download_registry_get_key_type (DownloadRegistry *self, const gchar *key)
+{
+    const gchar *ext = key ? strrchr (key, '.') : NULL;
+
+    return ext ? g_hash_table_lookup (self->priv->types, ext + 1) : NULL;
+}
+
+gboolean
+download_registry_has_key (DownloadRegistry *self, const gchar *key)
+{
+    return download_registry_get_key_type (self, key) != NULL;
+}
+
+Download*
+download_registry_load (DownloadRegistry *self, const gchar *key,
+    const gchar *data, gsize len)
+{
+    DownloadType *type = download_registry_get_key_type (self, key);
+
+    return type ? type->load (key, data, len) : NULL;
+}
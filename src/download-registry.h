@@ -0,0 +1,88 @@
+/*
+ *      download-registry.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#ifndef __DOWNLOAD_REGISTRY_H__
+#define __DOWNLOAD_REGISTRY_H__
+
+#include <glib-object.h>
+
+#include "download.h"
+
+#define DOWNLOAD_REGISTRY_TYPE (download_registry_get_type ())
+#define DOWNLOAD_REGISTRY(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), DOWNLOAD_REGISTRY_TYPE, DownloadRegistry))
+#define DOWNLOAD_REGISTRY_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), DOWNLOAD_REGISTRY_TYPE, DownloadRegistryClass))
+#define IS_DOWNLOAD_REGISTRY(object) (G_TYPE_CHECK_INSTANCE_TYPE ((object), DOWNLOAD_REGISTRY_TYPE))
+#define IS_DOWNLOAD_REGISTRY_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), DOWNLOAD_REGISTRY_TYPE))
+#define DOWNLOAD_REGISTRY_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), DOWNLOAD_REGISTRY_TYPE, DownloadRegistryClass))
+
+G_BEGIN_DECLS
+
+typedef struct _DownloadRegistry DownloadRegistry;
+typedef struct _DownloadRegistryClass DownloadRegistryClass;
+typedef struct _DownloadRegistryPrivate DownloadRegistryPrivate;
+
+typedef Download *(*DownloadNewFunc) (const gchar *source, const gchar *dest);
+typedef Download *(*DownloadLoadFunc) (const gchar *key, const gchar *data, gsize len);
+typedef void (*DownloadRegisterFunc) (DownloadRegistry *registry);
+
+struct _DownloadRegistry {
+    GObject parent;
+
+    DownloadRegistryPrivate *priv;
+};
+
+struct _DownloadRegistryClass {
+    GObjectClass parent;
+};
+
+/*
+ * Maps urls and saved state to the download types handling them. Every
+ * type registers once under its tag, the extension of its state store
+ * keys, and then claims schemes and hosts. A host pattern starting with a
+ * dot also matches every subdomain. The manager fills it in at startup,
+ * afterwards it is only read, from any thread.
+ */
+DownloadRegistry *download_registry_get_default (void);
+
+void download_registry_add_type (DownloadRegistry *self, const gchar *tag,
+    DownloadNewFunc create, DownloadLoadFunc load);
+void download_registry_add_scheme (DownloadRegistry *self, const gchar *scheme, const gchar *tag);
+void download_registry_add_host (DownloadRegistry *self, const gchar *pattern, const gchar *tag);
+
+// Call each function of a NULL terminated table, the types register themselves
+void download_registry_add_types (DownloadRegistry *self, const DownloadRegisterFunc *types);
+
+// Host part of a url without the port, NULL for schemes nobody handles
+gchar *download_registry_get_host (DownloadRegistry *self, const gchar *url);
+
+Download *download_registry_create (DownloadRegistry *self, const gchar *url,
+    const gchar *dest, const gchar *host);
+
+// Keys end in .<tag> of the type that saved them, the download keeps its key
+gboolean download_registry_has_key (DownloadRegistry *self, const gchar *key);
+Download *download_registry_load (DownloadRegistry *self, const gchar *key,
+    const gchar *data, gsize len);
+
+GType download_registry_get_type (void);
+
+G_END_DECLS
+
+#endif /* __DOWNLOAD_REGISTRY_H__ */
@@ -23,6 +23,7 @@
 
 static guint signal_state_changed;
 static guint signal_pos_changed;
+static guint signal_resolved;
 
 static void
 download_base_init (gpointer g_iface)
@@ -39,6 +40,10 @@ download_base_init (gpointer g_iface)
         signal_pos_changed = g_signal_new ("position-changed", DOWNLOAD_TYPE,
             G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__VOID,
             G_TYPE_NONE, 0);
+
+        signal_resolved = g_signal_new ("resolved", DOWNLOAD_TYPE,
+            G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__BOOLEAN,
+            G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
     }
 }
 
@@ -72,7 +77,19 @@ download_get_title (Download *self)
     }
 }
 
-gint
+const gchar*
+download_get_source (Download *self)
+{
+    DownloadInterface *iface = DOWNLOAD_GET_IFACE (self);
+
+    if (iface->get_source) {
+        return iface->get_source (self);
+    } else {
+        return NULL;
+    }
+}
+
+goffset
 download_get_size_total (Download *self)
 {
     DownloadInterface *iface = DOWNLOAD_GET_IFACE (self);
@@ -84,7 +101,7 @@ download_get_size_total (Download *self)
     }
 }
 
-gint
+goffset
 download_get_size_completed (Download *self)
 {
     DownloadInterface *iface = DOWNLOAD_GET_IFACE (self);
@@ -149,7 +166,7 @@ download_queue (Download *self)
 {
     DownloadInterface *iface = DOWNLOAD_GET_IFACE (self);
 
-    if (iface->start) {
+    if (iface->queue) {
         return iface->queue (self);
     } else {
         return FALSE;
@@ -192,6 +209,24 @@ download_pause (Download *self)
     }
 }
 
+gboolean
+download_can_resolve (Download *self)
+{
+    return DOWNLOAD_GET_IFACE (self)->resolve != NULL;
+}
+
+gboolean
+download_resolve (Download *self)
+{
+    DownloadInterface *iface = DOWNLOAD_GET_IFACE (self);
+
+    if (iface->resolve) {
+        return iface->resolve (self);
+    } else {
+        return FALSE;
+    }
+}
+
 gboolean
 download_export_to_file (Download *self)
 {
@@ -204,6 +239,18 @@ download_export_to_file (Download *self)
     }
 }
 
+gboolean
+download_forget (Download *self)
+{
+    DownloadInterface *iface = DOWNLOAD_GET_IFACE (self);
+
+    if (iface->forget) {
+        return iface->forget (self);
+    } else {
+        return FALSE;
+    }
+}
+
 
 void
 _emit_download_state_changed (Download *self, gint state)
@@ -217,6 +264,52 @@ _emit_download_position_changed (Download *self)
     g_signal_emit (self, signal_pos_changed, 0);
 }
 
+void
+_emit_download_resolved (Download *self, gboolean ok)
+{
+    g_signal_emit (self, signal_resolved, 0, ok);
+}
+
+gchar*
+_download_make_key (const gchar *source, const gchar *dest, const gchar *tag)
+{
+    gchar *str = g_strconcat (source, "\n", dest, NULL);
+    gchar *sum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, str, -1);
+    gchar *key = g_strconcat (sum, ".", tag, NULL);
+
+    g_free (sum);
+    g_free (str);
+
+    return key;
+}
+
+gboolean
+_download_begin_resolve (volatile gint *resolving)
+{
+    return g_atomic_int_compare_and_exchange (resolving,
+        DOWNLOAD_RESOLVE_IDLE, DOWNLOAD_RESOLVE_BUSY);
+}
+
+gboolean
+_download_join_resolve (volatile gint *resolving)
+{
+    return g_atomic_int_compare_and_exchange (resolving,
+        DOWNLOAD_RESOLVE_BUSY, DOWNLOAD_RESOLVE_JOINED) ||
+        g_atomic_int_get (resolving) == DOWNLOAD_RESOLVE_JOINED;
+}
+
+gint
+_download_end_resolve (volatile gint *resolving)
+{
+    gint old;
+
+    do {
+        old = g_atomic_int_get (resolving);
+    } while (!g_atomic_int_compare_and_exchange (resolving, old, DOWNLOAD_RESOLVE_IDLE));
+
+    return old;
+}
+
 gchar*
 time_to_string (gint time)
 {
@@ -234,13 +327,13 @@ time_to_string (gint time)
 }
 
 gchar*
-size_to_string (gint size)
+size_to_string (goffset size)
 {
     if (size < 1024) {
-        return g_strdup_printf ("%d bytes", size);
+        return g_strdup_printf ("%" G_GINT64_FORMAT " bytes", size);
     } else if (size < 1024*1024) {
         return g_strdup_printf ("%.2f KB", size / 1024.0);
-    } else if (size < 1024 * 1024 * 1024) {
+    } else if (size < G_GINT64_CONSTANT (1024) * 1024 * 1024) {
         return g_strdup_printf ("%.2f MB", size / (1024.0 * 1024.0));
     } else {
         return g_strdup_printf ("%.2f GB", size / (1024.0 * 1024.0 * 1024.0));
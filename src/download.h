@@ -22,7 +22,7 @@
 #ifndef __DOWNLOAD_H__
 #define __DOWNLOAD_H__
 
-#include <gtk/gtk.h>
+#include <glib-object.h>
 
 #define DOWNLOAD_TYPE (download_get_type ())
 #define DOWNLOAD(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), DOWNLOAD_TYPE, Download))
@@ -37,6 +37,14 @@ enum {
     DOWNLOAD_STATE_COMPLETED,
     DOWNLOAD_STATE_CANCELED,
     DOWNLOAD_STATE_STOPPED,
+    DOWNLOAD_STATE_ERROR,
+};
+
+// Where a resolve is, see _download_join_resolve
+enum {
+    DOWNLOAD_RESOLVE_IDLE = 0,
+    DOWNLOAD_RESOLVE_BUSY,
+    DOWNLOAD_RESOLVE_JOINED,
 };
 
 G_BEGIN_DECLS
@@ -48,9 +56,10 @@ struct _DownloadInterface {
     GTypeInterface parent;
 
     gchar* (*get_title) (Download *self);
+    const gchar* (*get_source) (Download *self);
 
-    gint   (*get_size_tot) (Download *self);
-    gint   (*get_size_comp) (Download *self);
+    goffset (*get_size_tot) (Download *self);
+    goffset (*get_size_comp) (Download *self);
 
     gint   (*get_time_tot) (Download *self);
     gint   (*get_time_rem) (Download *self);
@@ -63,15 +72,20 @@ struct _DownloadInterface {
     gboolean (*cancel) (Download *self);
     gboolean (*pause) (Download *self);
 
+    // Optional, for downloads that scrape pages before the transfer
+    gboolean (*resolve) (Download *self);
+
     gboolean (*export) (Download *self);
+    gboolean (*forget) (Download *self);
 };
 
 GType download_get_type (void);
 
 gchar *download_get_title (Download *self);
+const gchar *download_get_source (Download *self);
 
-gint download_get_size_total (Download *self);
-gint download_get_size_completed (Download *self);
+goffset download_get_size_total (Download *self);
+goffset download_get_size_completed (Download *self);
 
 gint download_get_time_total (Download *self);
 gint download_get_time_remaining (Download *self);
@@ -84,13 +98,44 @@ gboolean download_stop (Download *self);
 gboolean download_cancel (Download *self);
 gboolean download_pause (Download *self);
 
+/*
+ * Fetch what a queued download needs before its transfer, ahead of it
+ * getting a slot. Returns FALSE when there is nothing to do, otherwise
+ * "resolved" is emitted once done. Starting a download meanwhile goes on
+ * with its transfer as soon as resolving finished.
+ */
+gboolean download_can_resolve (Download *self);
+gboolean download_resolve (Download *self);
+
 gboolean download_export_to_file (Download *self);
 
+// Drop what export saved, once the download is removed for good
+gboolean download_forget (Download *self);
+
 void _emit_download_state_changed (Download *self, gint state);
 void _emit_download_position_changed (Download *self);
+void _emit_download_resolved (Download *self, gboolean ok);
+
+/*
+ * A start and the end of a resolve race on different threads, the flag
+ * they share only changes atomically. begin moves IDLE to BUSY and fails
+ * when a resolve is underway. join is called by a start after setting
+ * the state, when it returns TRUE the resolve goes on with the transfer.
+ * end sets IDLE and returns the old value, the resolve goes on only when
+ * that was JOINED, a later start does the transfer on its own.
+ */
+gboolean _download_begin_resolve (volatile gint *resolving);
+gboolean _download_join_resolve (volatile gint *resolving);
+gint _download_end_resolve (volatile gint *resolving);
+
+/*
+ * Key to save a download under, <hash>.<tag> with the hash taken over
+ * source and destination so that two downloads of one file keep apart.
+ */
+gchar *_download_make_key (const gchar *source, const gchar *dest, const gchar *tag);
 
 gchar *time_to_string (gint time);
-gchar *size_to_string (gint size);
+gchar *size_to_string (goffset size);
 
 G_END_DECLS
 
@@ -19,39 +19,112 @@
  *      MA 02110-1301, USA.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
+#include <glib/gstdio.h>
 #include <curl/curl.h>
 
 #include "http-download.h"
 
+#include "disk-writer.h"
 #include "download.h"
+#include "range-journal.h"
+#include "rate-limiter.h"
+#include "state-store.h"
+#include "transfer-engine.h"
 
 static void download_init (DownloadInterface *iface);
 G_DEFINE_TYPE_WITH_CODE (HttpDownload, http_download, G_TYPE_OBJECT,
     G_IMPLEMENT_INTERFACE (DOWNLOAD_TYPE, download_init)
 )
 
+// Number of ranges a file is split into and the smallest range worth
+// opening a separate connection for
+#define HTTP_DOWNLOAD_SEGMENTS 4
+#define HTTP_DOWNLOAD_MIN_SEGMENT (1024 * 1024)
+#define HTTP_DOWNLOAD_SEGMENT_RETRIES 3
+
+// Connections a segmented download grows to while each one added still
+// raises the total rate, checked every interval seconds
+#define HTTP_DOWNLOAD_MAX_SEGMENTS 8
+#define HTTP_DOWNLOAD_GROW_INTERVAL 4
+
+// A finished connection this many times slower than the fastest one is
+// closed instead of taking over part of another range
+#define HTTP_DOWNLOAD_SLOW_FACTOR 4
+
+typedef struct _HttpSegment HttpSegment;
+struct _HttpSegment {
+    HttpDownload *self;
+    CURL *curl;
+    DiskStream *out;
+
+    // Byte range [start, end] of the file, pos is the next byte to fetch
+    goffset start, pos, end;
+    gint retries;
+};
+
 struct _HttpDownloadPrivate {
     gchar *source, *dest;
 
+    // Saved state record, named when the download is first created
+    gchar *key;
+
     CURL *curl;
-    FILE *fptr;
-    GThread *main;
+    DiskFile *file;
+    DiskStream *out;
+
+    gboolean ranges;
+    GPtrArray *segments;
+    gint active;
+
+    // Total rate when the last connection was added, growing stops once
+    // another connection does not make the download faster
+    gboolean grow;
+    gdouble grow_rate;
+    time_t grow_time;
+
+    // Set until the headers of the first response were seen, which
+    // decide between resuming, restarting and splitting the download
+    gboolean probing, restart;
+    goffset length, range_start, range_total;
+
+    // Offset the first request asked for
+    goffset range_from;
+    RangeJournal *journal;
+    gchar *location;
+
+    // Segment carried by the connection of the first response
+    HttpSegment *lead;
+
+    // How the transfers ended, settled once the file is on disk
+    CURLcode result;
 
     gchar *title;
-    gint size, completed;
+    goffset size, completed;
     time_t ot;
 
+    // Total rate, published once a second by the engine thread for readers
+    // on other threads
+    gdouble rate;
+
+    // Guards the segments array and the bounds of its segments, which the
+    // engine thread changes while others walk them
+    GMutex *lock;
+
     gint state;
 };
 
 static gchar *http_download_get_title (Download *self);
-static gint http_download_get_size_total (Download *self);
-static gint http_download_get_size_completed (Download *self);
+static const gchar *http_download_get_source (Download *self);
+static goffset http_download_get_size_total (Download *self);
+static goffset http_download_get_size_completed (Download *self);
 static gint http_download_get_time_total (Download *self);
 static gint http_download_get_time_remaining (Download *self);
 static gboolean http_download_get_state (Download *self);
@@ -61,10 +134,23 @@ static gboolean http_download_stop (Download *self);
 static gboolean http_download_cancel (Download *self);
 static gboolean http_download_pause (Download *self);
 static gboolean http_download_export_to_file (Download *self);
+static gboolean http_download_forget (Download *self);
 
-gpointer http_download_main (HttpDownload *self);
 int http_download_progress (HttpDownload *self, gdouble dt, gdouble dn, gdouble ut, gdouble un);
 static size_t http_download_write_data (char *buff, size_t size, size_t num, HttpDownload *self);
+static size_t http_download_write_segment (char *buff, size_t size, size_t num, HttpSegment *seg);
+static size_t http_download_header_data (char *buff, size_t size, size_t num, HttpDownload *self);
+
+static gboolean http_download_begin (HttpDownload *self, glong code);
+static void http_download_done (CURL *curl, CURLcode res, HttpDownload *self);
+static void http_download_start_segments (HttpDownload *self, RangeJournal *journal, gboolean resume,
+    CURL *curl, goffset from);
+static void http_download_segment_done (CURL *curl, CURLcode res, HttpSegment *seg);
+static void http_download_finish_segments (HttpDownload *self, CURLcode res);
+static void http_download_written (gboolean ok, HttpDownload *self);
+static void http_download_allocated (gboolean ok, HttpDownload *self);
+static void http_download_segment_add (HttpDownload *self, HttpSegment *seg);
+static gboolean http_download_steal (HttpDownload *self, CURL *curl, gdouble rate);
 
 static int socket_connect (char *host, int port);
 
@@ -72,6 +158,7 @@ static void
 download_init (DownloadInterface *iface)
 {
     iface->get_title = http_download_get_title;
+    iface->get_source = http_download_get_source;
 
     iface->get_size_tot = http_download_get_size_total;
     iface->get_size_comp = http_download_get_size_completed;
@@ -88,6 +175,7 @@ download_init (DownloadInterface *iface)
     iface->pause = http_download_pause;
 
     iface->export = http_download_export_to_file;
+    iface->forget = http_download_forget;
 }
 
 static void
@@ -95,6 +183,16 @@ http_download_finalize (GObject *object)
 {
     HttpDownload *self = HTTP_DOWNLOAD (object);
 
+    g_free (self->priv->key);
+
+    if (self->priv->segments) {
+        g_ptr_array_foreach (self->priv->segments, (GFunc) g_free, NULL);
+        g_ptr_array_free (self->priv->segments, TRUE);
+    }
+
+    g_free (self->priv->location);
+    g_mutex_free (self->priv->lock);
+
     G_OBJECT_CLASS (http_download_parent_class)->finalize (object);
 }
 
@@ -119,6 +217,83 @@ http_download_init (HttpDownload *self)
 
     self->priv->size = 0;
     self->priv->completed = 0;
+
+    self->priv->file = NULL;
+    self->priv->out = NULL;
+    self->priv->ranges = FALSE;
+    self->priv->segments = NULL;
+
+    self->priv->journal = NULL;
+    self->priv->location = NULL;
+    self->priv->lead = NULL;
+
+    self->priv->rate = 0;
+    self->priv->lock = g_mutex_new ();
+}
+
+// Must be called with the lock held
+static HttpSegment*
+http_segment_new (HttpDownload *self, goffset start, goffset pos, goffset end)
+{
+    HttpSegment *seg = g_new0 (HttpSegment, 1);
+
+    seg->self = self;
+    seg->start = start;
+    seg->pos = pos;
+    seg->end = end;
+
+    if (!self->priv->segments) {
+        self->priv->segments = g_ptr_array_new ();
+    }
+
+    g_ptr_array_add (self->priv->segments, seg);
+
+    return seg;
+}
+
+static void
+http_download_load_segments (HttpDownload *self, const gchar *str)
+{
+    gint i;
+
+    if (!str || !str[0]) {
+        return;
+    }
+
+    gchar **ranges = g_strsplit (str, ";", 0);
+
+    g_mutex_lock (self->priv->lock);
+    for (i = 0; ranges[i]; i++) {
+        gchar **vals = g_strsplit (ranges[i], ",", 3);
+
+        if (g_strv_length (vals) == 3) {
+            http_segment_new (self,
+                g_ascii_strtoll (vals[0], NULL, 10),
+                g_ascii_strtoll (vals[1], NULL, 10),
+                g_ascii_strtoll (vals[2], NULL, 10));
+        }
+
+        g_strfreev (vals);
+    }
+    g_mutex_unlock (self->priv->lock);
+
+    g_strfreev (ranges);
+}
+
+static Download*
+http_download_create (const gchar *source, const gchar *dest)
+{
+    return http_download_new (source, dest, FALSE);
+}
+
+// Anything over http or https without a more specific type
+void
+http_download_register (DownloadRegistry *registry)
+{
+    download_registry_add_type (registry, HTTP_DOWNLOAD_TAG,
+        http_download_create, http_download_new_from_data);
+    download_registry_add_scheme (registry, "http", HTTP_DOWNLOAD_TAG);
+    download_registry_add_scheme (registry, "https", HTTP_DOWNLOAD_TAG);
 }
 
 Download*
@@ -145,33 +320,41 @@ http_download_new (const gchar *source, const gchar *dest, gboolean nohead)
     }
 
     self->priv->title = g_path_get_basename (self->priv->dest);
+    self->priv->key = _download_make_key (source, self->priv->dest, HTTP_DOWNLOAD_TAG);
 
     return DOWNLOAD (self);
 }
 
 Download*
-http_download_new_from_file (const gchar *filename)
+http_download_new_from_data (const gchar *key, const gchar *data, gsize len)
 {
     GError *err = NULL;
     GKeyFile *kf = g_key_file_new ();
 
     HttpDownload *self = g_object_new (HTTP_DOWNLOAD_TYPE, NULL);
 
-    g_key_file_load_from_file (kf, filename, G_KEY_FILE_NONE, &err);
+    g_key_file_load_from_data (kf, data, len, G_KEY_FILE_NONE, &err);
 
     if (err) {
-        g_print ("Error loading %s: %s\n", filename, err->message);
+        g_print ("Error loading download: %s\n", err->message);
         g_error_free (err);
         err = NULL;
     }
 
+    self->priv->key = g_strdup (key);
     self->priv->source = g_key_file_get_string (kf, "Download", "Source", NULL);
     self->priv->dest = g_key_file_get_string (kf, "Download", "Destination", NULL);
     self->priv->state = g_key_file_get_integer (kf, "Download", "State", NULL);
-    self->priv->size = g_key_file_get_integer (kf, "Download", "Size", NULL);
-    self->priv->completed = g_key_file_get_integer (kf, "Download", "Completed", NULL);
+    self->priv->size = g_key_file_get_int64 (kf, "Download", "Size", NULL);
+    self->priv->completed = g_key_file_get_int64 (kf, "Download", "Completed", NULL);
     self->priv->title = g_path_get_basename (self->priv->dest);
 
+    gchar *segments = g_key_file_get_string (kf, "Download", "Segments", NULL);
+    http_download_load_segments (self, segments);
+    g_free (segments);
+
+    g_key_file_free (kf);
+
     return DOWNLOAD (self);
 }
 
@@ -179,40 +362,49 @@ static gboolean
 http_download_export_to_file (Download *self)
 {
     HttpDownloadPrivate *priv = HTTP_DOWNLOAD (self)->priv;
-    gint i = strlen (priv->source);
-    while (priv->source[i--] != '/');
+    gint i;
 
-    gchar *str = g_strdup_printf ("%s/gdman/%s.http", g_get_user_config_dir (), priv->source+i+2);
-    FILE *fptr = fopen (str, "w");
-    g_free (str);
-
-    if (priv->state == DOWNLOAD_STATE_RUNNING) {
-        priv->state = DOWNLOAD_STATE_QUEUED;
-        g_thread_join (priv->main);
+    // Transfers are dropped by the engine shutdown before the final export,
+    // a running download is picked up again on the next start
+    gint state = priv->state;
+    if (state == DOWNLOAD_STATE_RUNNING) {
+        state = DOWNLOAD_STATE_QUEUED;
     }
 
-    gchar *group = "[Download]\n";
-    fwrite (group, 1, strlen (group), fptr);
-
-    fwrite ("Source=", 1, 7, fptr);
-    fwrite (priv->source, 1, strlen (priv->source), fptr);
+    GString *str = g_string_new ("[Download]\n");
+
+    g_string_append_printf (str, "Source=%s\n", priv->source);
+    g_string_append_printf (str, "Destination=%s\n", priv->dest);
+    g_string_append_printf (str, "State=%d\n", state);
+    g_string_append_printf (str, "Size=%" G_GINT64_FORMAT "\n", priv->size);
+    g_string_append_printf (str, "Completed=%" G_GINT64_FORMAT "\n", priv->completed);
+
+    // State changes are saved from whichever thread made them
+    g_mutex_lock (priv->lock);
+    if (priv->segments && priv->segments->len > 0) {
+        g_string_append (str, "Segments=");
+        for (i = 0; i < priv->segments->len; i++) {
+            HttpSegment *seg = priv->segments->pdata[i];
+            g_string_append_printf (str, "%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT ";",
+                seg->start, seg->pos, seg->end);
+        }
+        g_string_append (str, "\n");
+    }
+    g_mutex_unlock (priv->lock);
 
-    fwrite ("\nDestination=", 1, 13, fptr);
-    fwrite (priv->dest, 1, strlen (priv->dest), fptr);
+    state_store_put (state_store_get_default (), priv->key, str->str, str->len);
 
-    str = g_strdup_printf ("\nState=%d", priv->state);
-    fwrite (str, 1, strlen (str), fptr);
-    g_free (str);
+    g_string_free (str, TRUE);
 
-    str = g_strdup_printf ("\nSize=%d\n", priv->size);
-    fwrite (str, 1, strlen (str), fptr);
-    g_free (str);
+    return TRUE;
+}
 
-    str = g_strdup_printf ("Completed=%d\n", priv->completed);
-    fwrite (str, 1, strlen (str), fptr);
-    g_free (str);
+static gboolean
+http_download_forget (Download *self)
+{
+    state_store_remove (state_store_get_default (), HTTP_DOWNLOAD (self)->priv->key);
 
-    fclose (fptr);
+    return TRUE;
 }
 
 gchar*
@@ -221,16 +413,23 @@ http_download_get_title (Download *self)
     return HTTP_DOWNLOAD (self)->priv->title;
 }
 
-gint
+const gchar*
+http_download_get_source (Download *self)
+{
+    return HTTP_DOWNLOAD (self)->priv->source;
+}
+
+goffset
 http_download_get_size_total (Download *self)
 {
     HttpDownloadPrivate *priv = HTTP_DOWNLOAD (self)->priv;
     return !priv->size ? -1 : priv->size;
 }
 
-gint
+goffset
 http_download_get_size_completed (Download *self)
 {
+    // Counts the bytes of every segment as well
     return HTTP_DOWNLOAD (self)->priv->completed;
 }
 
@@ -249,8 +448,10 @@ http_download_get_time_remaining (Download *self)
         return -1;
     }
 
-    gdouble cr;
-    curl_easy_getinfo (priv->curl, CURLINFO_SPEED_DOWNLOAD, &cr);
+    // The handles belong to the engine thread, use the rate it published
+    g_mutex_lock (priv->lock);
+    gdouble cr = priv->rate;
+    g_mutex_unlock (priv->lock);
 
     if (cr != 0) {
         return (priv->size - priv->completed) / cr;
@@ -268,26 +469,219 @@ http_download_get_state (Download *self)
 static size_t
 http_download_write_data (char *buff, size_t size, size_t num, HttpDownload *self)
 {
-    if (self->priv->state == DOWNLOAD_STATE_RUNNING) {
-        fwrite (buff, size, num, self->priv->fptr);
-        self->priv->completed += num * size;
-    } else {
+    if (self->priv->state != DOWNLOAD_STATE_RUNNING) {
         return -1;
     }
 
+    if (self->priv->lead) {
+        return http_download_write_segment (buff, size, num, self->priv->lead);
+    }
+
+    if (!rate_limiter_consume (rate_limiter_get_default (), DOWNLOAD (self),
+            self->priv->curl, size * num)) {
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    switch (disk_stream_write (self->priv->out, buff, size * num)) {
+        case DISK_STREAM_FULL:
+            // The chunk comes again once the writer caught up
+            rate_limiter_refund (rate_limiter_get_default (), DOWNLOAD (self), size * num);
+            return CURL_WRITEFUNC_PAUSE;
+        case DISK_STREAM_ERROR:
+            return -1;
+    }
+
+    self->priv->completed += num * size;
+
     return size * num;
 }
 
+static size_t
+http_download_write_segment (char *buff, size_t size, size_t num, HttpSegment *seg)
+{
+    HttpDownloadPrivate *priv = seg->self->priv;
+    goffset len = size * num;
+
+    if (priv->state != DOWNLOAD_STATE_RUNNING) {
+        return -1;
+    }
+
+    // An open ended response or a range whose back was handed to another
+    // connection is cut off once the segment is complete
+    if (seg->pos > seg->end) {
+        return 0;
+    }
+
+    // Servers may send past the end of the requested range, drop the rest
+    if (seg->pos + len > seg->end + 1) {
+        len = seg->end + 1 - seg->pos;
+    }
+
+    if (!rate_limiter_consume (rate_limiter_get_default (), DOWNLOAD (seg->self),
+            seg->curl, size * num)) {
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    if (len > 0) {
+        switch (disk_stream_write (seg->out, buff, len)) {
+            case DISK_STREAM_FULL:
+                // The chunk comes again once the writer caught up
+                rate_limiter_refund (rate_limiter_get_default (), DOWNLOAD (seg->self), size * num);
+                return CURL_WRITEFUNC_PAUSE;
+            case DISK_STREAM_ERROR:
+                return -1;
+        }
+    }
+
+    seg->pos += len;
+    priv->completed += len;
+
+    return size * num;
+}
+
+static void
+http_download_content_range (HttpDownload *self, const gchar *buff, gsize len)
+{
+    // bytes <start>-<end>/<total>, either side may be a '*'
+    gchar *val = g_strndup (buff, len);
+    gchar *p = val;
+
+    while (*p == ' ' || *p == '\t') p++;
+    if (g_ascii_strncasecmp (p, "bytes", 5) == 0) {
+        p += 5;
+    }
+    while (*p == ' ' || *p == '\t') p++;
+
+    if (g_ascii_isdigit (*p)) {
+        self->priv->range_start = g_ascii_strtoll (p, NULL, 10);
+    }
+
+    p = strchr (p, '/');
+    if (p && g_ascii_isdigit (p[1])) {
+        self->priv->range_total = g_ascii_strtoll (p + 1, NULL, 10);
+    }
+
+    g_free (val);
+}
+
+static size_t
+http_download_header_data (char *buff, size_t size, size_t num, HttpDownload *self)
+{
+    HttpDownloadPrivate *priv = self->priv;
+    gsize len = size * num;
+
+    if (!priv->probing) {
+        return len;
+    }
+
+    if (len > 5 && g_ascii_strncasecmp (buff, "HTTP/", 5) == 0) {
+        // Every response of a redirect chain starts over
+        priv->ranges = FALSE;
+        priv->length = priv->range_start = priv->range_total = -1;
+    } else if (len > 14 && g_ascii_strncasecmp (buff, "Accept-Ranges:", 14) == 0) {
+        if (g_strstr_len (buff + 14, len - 14, "bytes")) {
+            priv->ranges = TRUE;
+        }
+    } else if (len > 15 && g_ascii_strncasecmp (buff, "Content-Length:", 15) == 0) {
+        gchar *val = g_strndup (buff + 15, len - 15);
+        priv->length = g_ascii_strtoll (val, NULL, 10);
+        g_free (val);
+    } else if (len > 14 && g_ascii_strncasecmp (buff, "Content-Range:", 14) == 0) {
+        // A partial response proves range support on its own
+        priv->ranges = TRUE;
+        http_download_content_range (self, buff + 14, len - 14);
+    } else if (buff[0] == '\r' || buff[0] == '\n') {
+        glong code = 0;
+        curl_easy_getinfo (priv->curl, CURLINFO_RESPONSE_CODE, &code);
+
+        // Interim responses and redirects being followed are skipped
+        if (code / 100 == 1 || code / 100 == 3) {
+            return len;
+        }
+
+        priv->probing = FALSE;
+        if (!http_download_begin (self, code)) {
+            return 0;
+        }
+    }
+
+    return len;
+}
+
 gboolean
 http_download_start (Download *self)
 {
     HttpDownloadPrivate *priv = HTTP_DOWNLOAD (self)->priv;
-
-    priv->main = g_thread_create ((GThreadFunc) http_download_main,
-        HTTP_DOWNLOAD (self), TRUE, NULL);
+    gint i;
 
     priv->state = DOWNLOAD_STATE_RUNNING;
     _emit_download_state_changed (self, priv->state);
+
+    if (!priv->curl) {
+        priv->curl = transfer_engine_get_handle (transfer_engine_get_default ());
+    }
+
+    // Only the ranges journaled as synced are known to be on disk, the
+    // saved progress may be ahead of them
+    if (priv->size > 0) {
+        priv->journal = range_journal_open (priv->dest, priv->size);
+    }
+
+    // The body is requested straight away, starting where the journaled
+    // progress ends. Whether the server honoured that is only known from
+    // the response headers, http_download_begin settles it there.
+    goffset from = 0, to = -1;
+
+    if (priv->segments && priv->segments->len > 0) {
+        // Ask for the first unfinished segment only
+        priv->completed = 0;
+        for (i = 0; i < priv->segments->len; i++) {
+            HttpSegment *seg = priv->segments->pdata[i];
+
+            seg->pos = priv->journal ?
+                MIN (range_journal_contiguous (priv->journal, seg->start), seg->end + 1) : seg->start;
+            priv->completed += seg->pos - seg->start;
+
+            if (seg->pos <= seg->end && to < 0) {
+                from = seg->pos;
+                to = seg->end;
+            }
+        }
+    } else {
+        priv->completed = priv->journal ? range_journal_contiguous (priv->journal, 0) : 0;
+        from = priv->completed;
+    }
+
+    gchar *range = NULL;
+    if (to >= 0) {
+        range = g_strdup_printf ("%" G_GINT64_FORMAT "-%" G_GINT64_FORMAT, from, to);
+    } else if (from > 0) {
+        range = g_strdup_printf ("%" G_GINT64_FORMAT "-", from);
+    }
+
+    curl_easy_setopt (priv->curl, CURLOPT_URL, priv->source);
+    curl_easy_setopt (priv->curl, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt (priv->curl, CURLOPT_RANGE, range);
+    curl_easy_setopt (priv->curl, CURLOPT_HEADERFUNCTION, (curl_write_callback) http_download_header_data);
+    curl_easy_setopt (priv->curl, CURLOPT_HEADERDATA, self);
+
+    curl_easy_setopt (priv->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback) http_download_write_data);
+    curl_easy_setopt (priv->curl, CURLOPT_WRITEDATA, self);
+
+    curl_easy_setopt (priv->curl, CURLOPT_NOPROGRESS, 0);
+    curl_easy_setopt (priv->curl, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback) http_download_progress);
+    curl_easy_setopt (priv->curl, CURLOPT_PROGRESSDATA, self);
+
+    g_free (range);
+
+    priv->range_from = from;
+    priv->ranges = FALSE;
+    priv->probing = TRUE;
+    priv->restart = FALSE;
+    priv->length = priv->range_start = priv->range_total = -1;
+
+    transfer_engine_add (transfer_engine_get_default (), priv->curl, G_OBJECT (self),
+        (TransferDoneFunc) http_download_done, self);
 }
 
 gboolean
@@ -318,79 +712,652 @@ http_download_pause (Download *self)
 
     switch (priv->state) {
         case DOWNLOAD_STATE_RUNNING:
+            // The write callback aborts the transfer on its next chunk
             priv->state = DOWNLOAD_STATE_PAUSED;
-            g_thread_join (priv->main);
+            _emit_download_state_changed (self, priv->state);
             break;
 //        default:
     };
 }
 
+static gdouble
+http_segment_get_rate (HttpSegment *seg)
+{
+    gdouble rate = 0;
+
+    if (seg->curl) {
+        curl_easy_getinfo (seg->curl, CURLINFO_SPEED_DOWNLOAD, &rate);
+    }
+
+    return rate;
+}
+
+static void
+http_download_publish_rate (HttpDownload *self)
+{
+    HttpDownloadPrivate *priv = self->priv;
+    gdouble rate = 0;
+    gint i;
+
+    if (priv->segments && priv->segments->len > 0) {
+        for (i = 0; i < priv->segments->len; i++) {
+            rate += http_segment_get_rate (priv->segments->pdata[i]);
+        }
+    } else if (priv->curl) {
+        curl_easy_getinfo (priv->curl, CURLINFO_SPEED_DOWNLOAD, &rate);
+    }
+
+    g_mutex_lock (priv->lock);
+    priv->rate = rate;
+    g_mutex_unlock (priv->lock);
+}
+
+/*
+ * Open one more connection for a segmented download as long as the last one
+ * added raised the total rate by a tenth, a link that is already full stops
+ * gaining connections after the first try.
+ */
+static void
+http_download_grow (HttpDownload *self)
+{
+    HttpDownloadPrivate *priv = self->priv;
+    gdouble rate = 0;
+    gint i;
+
+    if (!priv->grow || !priv->file || priv->active == 0 || priv->active >= HTTP_DOWNLOAD_MAX_SEGMENTS) {
+        return;
+    }
+
+    for (i = 0; i < priv->segments->len; i++) {
+        rate += http_segment_get_rate (priv->segments->pdata[i]);
+    }
+
+    if (priv->grow_rate > 0 && rate < priv->grow_rate * 1.1) {
+        priv->grow = FALSE;
+        return;
+    }
+
+    CURL *curl = transfer_engine_get_handle (transfer_engine_get_default ());
+
+    if (http_download_steal (self, curl, rate / priv->active)) {
+        priv->grow_rate = rate;
+    } else {
+        transfer_engine_release_handle (transfer_engine_get_default (), curl);
+    }
+}
+
 int
 http_download_progress (HttpDownload *self, gdouble dt, gdouble dn, gdouble ut, gdouble un)
 {
+    // A stalled connection of a paused download is dropped here as well
+    if (self->priv->state != DOWNLOAD_STATE_RUNNING) {
+        return -1;
+    }
+
     time_t nt = time (NULL);
 
     if (nt != self->priv->ot) {
         self->priv->ot = nt;
+        http_download_publish_rate (self);
         _emit_download_position_changed (DOWNLOAD (self));
     }
 
+    if (self->priv->segments && nt - self->priv->grow_time >= HTTP_DOWNLOAD_GROW_INTERVAL) {
+        self->priv->grow_time = nt;
+        http_download_grow (self);
+    }
+
     return 0;
 }
 
-gpointer
-http_download_main (HttpDownload *self)
+static gboolean
+http_download_begin (HttpDownload *self, glong code)
 {
-    self->priv->curl = curl_easy_init ();
+    HttpDownloadPrivate *priv = self->priv;
+    RangeJournal *journal = priv->journal;
+    goffset cl = code == 206 || code == 416 ? priv->range_total : priv->length;
+    gint fd;
+
+    priv->journal = NULL;
+
+    if (code / 100 != 2 && code != 416) {
+        g_print ("Error fetching %s: HTTP %ld\n", priv->source, code);
+        if (journal) {
+            range_journal_free (journal);
+        }
+
+        priv->state = DOWNLOAD_STATE_STOPPED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return FALSE;
+    }
+
+    // Segments skip the redirects on their own requests
+    gchar *url = NULL;
+    curl_easy_getinfo (priv->curl, CURLINFO_EFFECTIVE_URL, &url);
+    g_free (priv->location);
+    priv->location = g_strdup (url);
+
+    // A journal kept for another length describes an older file
+    if (journal && cl != priv->size) {
+        range_journal_free (journal);
+        journal = NULL;
+    }
+
+    if (!journal && cl > 0) {
+        journal = range_journal_open (priv->dest, cl);
+    }
+
+    // A destination removed or cut short since lost what the journal holds
+    if (journal && !range_journal_fits (journal, priv->dest)) {
+        range_journal_reset (journal);
+        priv->completed = 0;
+    }
+
+    if (cl > 0 && priv->completed == cl) {
+        // Download is completed, the range asked for lies past the end
+        if (journal) {
+            range_journal_discard (journal);
+        }
+
+        priv->size = cl;
+        priv->state = DOWNLOAD_STATE_COMPLETED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return FALSE;
+    }
+
+    if (code == 206 || code == 416) {
+        goffset from = priv->range_from;
+
+        if (code == 416 || priv->range_start != from || cl != priv->size ||
+            !journal || range_journal_is_empty (journal)) {
+            // The saved progress belongs to another version of the file or
+            // is gone from disk, start over once this response is dropped
+            if (journal) {
+                range_journal_reset (journal);
+                range_journal_free (journal);
+            }
+
+            priv->restart = TRUE;
+            return FALSE;
+        }
+
+        if (priv->segments && priv->segments->len > 0) {
+            http_download_start_segments (self, journal, TRUE, priv->curl, from);
+            return priv->lead != NULL;
+        }
+
+        fd = g_open (priv->dest, O_WRONLY, 0644);
+    } else if (priv->ranges && cl >= 2 * HTTP_DOWNLOAD_MIN_SEGMENT) {
+        // Only a journal of a file of this size has anything to resume
+        gboolean resume = journal && !range_journal_is_empty (journal);
+
+        // Segments saved for another length are split again
+        g_mutex_lock (priv->lock);
+        if (priv->segments && priv->size != cl) {
+            g_ptr_array_foreach (priv->segments, (GFunc) g_free, NULL);
+            g_ptr_array_set_size (priv->segments, 0);
+        }
+        g_mutex_unlock (priv->lock);
+
+        // This response becomes the first segment, or is dropped when that
+        // segment is already on disk
+        priv->size = cl;
+        http_download_start_segments (self, journal, resume, priv->curl, 0);
+        return priv->lead != NULL;
+    } else {
+        // Either the download is new, the server ignored the range or an
+        // error occured so start over with this response
+        priv->completed = 0;
+        fd = g_open (priv->dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (journal) {
+            range_journal_reset (journal);
+        }
+    }
+
+    priv->size = cl;
+
+    if (fd == -1) {
+        g_print ("Error opening %s\n", priv->dest);
+        if (journal) {
+            range_journal_free (journal);
+        }
+
+        priv->state = DOWNLOAD_STATE_STOPPED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return FALSE;
+    }
+
+    priv->file = disk_file_new (fd);
+    disk_file_set_journal (priv->file, journal);
+
+    if (cl > 0) {
+        disk_file_allocate (priv->file, cl,
+            (DiskFileDoneFunc) http_download_allocated, g_object_ref (self));
+    }
+
+    priv->out = disk_stream_new (priv->file, priv->completed, priv->curl);
+
+    return TRUE;
+}
+
+static void
+http_download_done (CURL *curl, CURLcode res, HttpDownload *self)
+{
+    HttpDownloadPrivate *priv = self->priv;
+
+    if (priv->lead) {
+        // The first segment owns this connection since the headers came in
+        HttpSegment *seg = priv->lead;
+        priv->lead = NULL;
+
+        curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, NULL);
+        http_download_segment_done (curl, res, seg);
+        return;
+    }
+
+    if (priv->restart) {
+        gint i;
 
-    self->priv->state = DOWNLOAD_STATE_RUNNING;
-    _emit_download_state_changed (DOWNLOAD (self), self->priv->state);
+        g_mutex_lock (priv->lock);
+        for (i = 0; priv->segments && i < priv->segments->len; i++) {
+            g_free (priv->segments->pdata[i]);
+        }
 
-    // Get file length in a HEAD request
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, self->priv->source);
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOBODY, 1);
+        if (priv->segments) {
+            g_ptr_array_set_size (priv->segments, 0);
+        }
+        g_mutex_unlock (priv->lock);
 
-    curl_easy_perform (self->priv->curl);
+        priv->size = 0;
+        priv->completed = 0;
 
-    gdouble cl;
-    curl_easy_getinfo (self->priv->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &cl);
+        // A restart during shutdown is left to the next start
+        if (priv->state == DOWNLOAD_STATE_RUNNING &&
+            transfer_engine_is_running (transfer_engine_get_default ())) {
+            http_download_start (DOWNLOAD (self));
+            return;
+        }
 
-    struct stat ostat;
-    g_stat (self->priv->dest, &ostat);
+        transfer_engine_release_handle (transfer_engine_get_default (), curl);
+        priv->curl = NULL;
+        return;
+    }
+
+    if (!priv->out) {
+        // Either the headers never arrived, or they finished the download
+        // or handed it to the segments
+        if (priv->probing && priv->state == DOWNLOAD_STATE_RUNNING && res != CURLE_ABORTED_BY_CALLBACK) {
+            g_print ("Error fetching %s: %s\n", priv->source, curl_easy_strerror (res));
 
-    self->priv->size = cl;
-    if (ostat.st_size > 0 && ostat.st_size == self->priv->completed && ostat.st_size < cl) {
-        // If file has a length > 0 and is the same as the stored completed value
-        // and the file is not already downloaded, continue where left off
-        self->priv->completed = ostat.st_size;
-        curl_easy_setopt (self->priv->curl, CURLOPT_RESUME_FROM, (long) self->priv->completed);
+            priv->state = DOWNLOAD_STATE_STOPPED;
+            _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        }
 
-        self->priv->fptr = fopen (self->priv->dest, "a");
-    } else if (ostat.st_size == cl) {
-        // Download is completed
-        self->priv->state = DOWNLOAD_STATE_COMPLETED;
+        if (priv->journal) {
+            range_journal_free (priv->journal);
+            priv->journal = NULL;
+        }
+
+        transfer_engine_release_handle (transfer_engine_get_default (), curl);
+        priv->curl = NULL;
         return;
+    }
+
+    disk_stream_close (priv->out);
+    priv->out = NULL;
+
+    // The state is only settled once the writer has the data on disk
+    priv->result = res;
+    disk_file_finish (priv->file, res == CURLE_OK,
+        (DiskFileDoneFunc) http_download_written, g_object_ref (self));
+
+    disk_file_unref (priv->file);
+    priv->file = NULL;
+
+    transfer_engine_release_handle (transfer_engine_get_default (), priv->curl);
+    priv->curl = NULL;
+}
+
+/*
+ * Called from the writer thread once the file has its space, a download
+ * that cannot get it fails right away instead of part way through.
+ */
+static void
+http_download_allocated (gboolean ok, HttpDownload *self)
+{
+    HttpDownloadPrivate *priv = self->priv;
+
+    if (!ok && priv->state == DOWNLOAD_STATE_RUNNING) {
+        priv->state = DOWNLOAD_STATE_ERROR;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+    }
+
+    g_object_unref (self);
+}
+
+/*
+ * Called from the writer thread once everything received is written and
+ * synced, or failed to be.
+ */
+static void
+http_download_written (gboolean ok, HttpDownload *self)
+{
+    HttpDownloadPrivate *priv = self->priv;
+    CURLcode res = ok ? priv->result : CURLE_WRITE_ERROR;
+
+    if (res == CURLE_OK) {
+        priv->state = DOWNLOAD_STATE_COMPLETED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+    } else if (priv->state == DOWNLOAD_STATE_RUNNING && priv->result != CURLE_ABORTED_BY_CALLBACK) {
+        // The journal keeps what made it to disk for the next start
+        g_print ("Error fetching %s: %s\n", priv->source, curl_easy_strerror (res));
+
+        priv->state = ok ? DOWNLOAD_STATE_STOPPED : DOWNLOAD_STATE_ERROR;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+    }
+
+    g_object_unref (self);
+}
+
+static void
+http_download_split_segments (HttpDownload *self)
+{
+    HttpDownloadPrivate *priv = self->priv;
+    gint i, num = HTTP_DOWNLOAD_SEGMENTS;
+
+    g_mutex_lock (priv->lock);
+
+    if (priv->segments) {
+        g_ptr_array_foreach (priv->segments, (GFunc) g_free, NULL);
+        g_ptr_array_set_size (priv->segments, 0);
+    }
+
+    if (priv->size / num < HTTP_DOWNLOAD_MIN_SEGMENT) {
+        num = priv->size / HTTP_DOWNLOAD_MIN_SEGMENT;
+    }
+
+    goffset len = priv->size / num;
+    for (i = 0; i < num; i++) {
+        goffset start = i * len;
+        goffset end = i == num - 1 ? priv->size - 1 : start + len - 1;
+        http_segment_new (self, start, start, end);
+    }
+
+    g_mutex_unlock (priv->lock);
+}
+
+static void
+http_download_segment_add (HttpDownload *self, HttpSegment *seg)
+{
+    gchar *range = g_strdup_printf ("%" G_GINT64_FORMAT "-%" G_GINT64_FORMAT, seg->pos, seg->end);
+
+    if (!seg->curl) {
+        seg->curl = transfer_engine_get_handle (transfer_engine_get_default ());
+    }
+
+    seg->out = disk_stream_new (self->priv->file, seg->pos, seg->curl);
+
+    curl_easy_setopt (seg->curl, CURLOPT_URL, self->priv->location ? self->priv->location : self->priv->source);
+    curl_easy_setopt (seg->curl, CURLOPT_RANGE, range);
+
+    curl_easy_setopt (seg->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback) http_download_write_segment);
+    curl_easy_setopt (seg->curl, CURLOPT_WRITEDATA, seg);
+
+    curl_easy_setopt (seg->curl, CURLOPT_NOPROGRESS, 0);
+    curl_easy_setopt (seg->curl, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback) http_download_progress);
+    curl_easy_setopt (seg->curl, CURLOPT_PROGRESSDATA, self);
+
+    transfer_engine_add (transfer_engine_get_default (), seg->curl, G_OBJECT (self),
+        (TransferDoneFunc) http_download_segment_done, seg);
+
+    g_free (range);
+}
+
+static void
+http_download_start_segments (HttpDownload *self, RangeJournal *journal, gboolean resume,
+    CURL *curl, goffset from)
+{
+    HttpDownloadPrivate *priv = self->priv;
+    gint i;
+
+    gint fd;
+
+    if (resume) {
+        // A journal alone is enough to resume, the ranges are split the
+        // same way for the same size
+        if (!priv->segments || priv->segments->len == 0) {
+            http_download_split_segments (self);
+        }
+
+        fd = g_open (priv->dest, O_WRONLY, 0644);
     } else {
-        // Either the download is new or an error occured so start over
-        self->priv->fptr = fopen (self->priv->dest, "w");
+        http_download_split_segments (self);
+        fd = g_open (priv->dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (journal) {
+            range_journal_reset (journal);
+        }
     }
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, self->priv->source);
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOBODY, 0);
+    if (fd == -1) {
+        g_print ("Error opening %s\n", priv->dest);
+        if (journal) {
+            range_journal_free (journal);
+        }
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback) http_download_write_data);
-    curl_easy_setopt (self->priv->curl, CURLOPT_WRITEDATA, self);
+        priv->state = DOWNLOAD_STATE_STOPPED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return;
+    }
+
+    priv->file = disk_file_new (fd);
+    disk_file_set_journal (priv->file, journal);
+
+    // Reserve the whole file before any segment writes at its offset
+    if (!resume) {
+        disk_file_allocate (priv->file, priv->size,
+            (DiskFileDoneFunc) http_download_allocated, g_object_ref (self));
+    }
+
+    priv->completed = 0;
+    priv->active = 0;
+    priv->grow = TRUE;
+    priv->grow_rate = 0;
+    priv->grow_time = time (NULL);
+    for (i = 0; i < priv->segments->len; i++) {
+        HttpSegment *seg = priv->segments->pdata[i];
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOPROGRESS, 0);
-    curl_easy_setopt (self->priv->curl, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback) http_download_progress);
-    curl_easy_setopt (self->priv->curl, CURLOPT_PROGRESSDATA, self);
+        seg->pos = journal ?
+            MIN (range_journal_contiguous (journal, seg->start), seg->end + 1) : seg->start;
 
-    gint res = curl_easy_perform (self->priv->curl);
+        priv->completed += seg->pos - seg->start;
+        seg->retries = 0;
 
-    fclose (self->priv->fptr);
+        if (seg->pos <= seg->end) {
+            priv->active++;
+        }
+    }
 
-    if (res == 0) {
-        self->priv->state = DOWNLOAD_STATE_COMPLETED;
-        _emit_download_state_changed (DOWNLOAD (self), self->priv->state);
+    if (priv->active == 0) {
+        http_download_finish_segments (self, CURLE_OK);
+        return;
     }
+
+    for (i = 0; i < priv->segments->len; i++) {
+        HttpSegment *seg = priv->segments->pdata[i];
+
+        if (seg->pos > seg->end) {
+            continue;
+        }
+
+        if (curl && seg->pos == from) {
+            // The response already underway carries this segment
+            seg->curl = curl;
+            seg->out = disk_stream_new (priv->file, seg->pos, seg->curl);
+            priv->lead = seg;
+            priv->curl = NULL;
+            curl = NULL;
+        } else {
+            http_download_segment_add (self, seg);
+        }
+    }
+}
+
+/*
+ * Hand curl a range still to be fetched: a range whose connection gave up,
+ * or else the back of the range expected to finish last. The split point
+ * lets both connections end at about the same time at their current rates.
+ * Returns FALSE when no range is worth splitting.
+ */
+static gboolean
+http_download_steal (HttpDownload *self, CURL *curl, gdouble rate)
+{
+    HttpDownloadPrivate *priv = self->priv;
+    HttpSegment *victim = NULL;
+    gdouble worst = 0;
+    gint i;
+
+    for (i = 0; i < priv->segments->len; i++) {
+        HttpSegment *seg = priv->segments->pdata[i];
+        goffset left = seg->end + 1 - seg->pos;
+
+        if (left <= 0) {
+            continue;
+        }
+
+        if (!seg->curl) {
+            seg->curl = curl;
+            seg->retries = 0;
+            priv->active++;
+
+            http_download_segment_add (self, seg);
+            return TRUE;
+        }
+
+        gdouble srate = http_segment_get_rate (seg);
+        gdouble eta = srate > 0 ? left / srate : G_MAXDOUBLE;
+
+        if (left >= 2 * HTTP_DOWNLOAD_MIN_SEGMENT && (!victim || eta > worst)) {
+            victim = seg;
+            worst = eta;
+        }
+    }
+
+    if (!victim) {
+        return FALSE;
+    }
+
+    goffset left = victim->end + 1 - victim->pos;
+    gdouble vrate = http_segment_get_rate (victim);
+    goffset keep = left / 2;
+
+    if (vrate > 0 && rate > 0) {
+        keep = left * (vrate / (vrate + rate));
+    }
+
+    keep = CLAMP (keep, HTTP_DOWNLOAD_MIN_SEGMENT, left - HTTP_DOWNLOAD_MIN_SEGMENT);
+
+    g_mutex_lock (priv->lock);
+    HttpSegment *seg = http_segment_new (self, victim->pos + keep, victim->pos + keep, victim->end);
+    victim->end = seg->start - 1;
+    g_mutex_unlock (priv->lock);
+
+    seg->curl = curl;
+    priv->active++;
+
+    http_download_segment_add (self, seg);
+    return TRUE;
+}
+
+/*
+ * Whether a connection that ran at rate is far behind the fastest one still
+ * running, the rest of the download is better left to the others.
+ */
+static gboolean
+http_download_is_slow (HttpDownload *self, gdouble rate)
+{
+    HttpDownloadPrivate *priv = self->priv;
+    gdouble fastest = 0;
+    gint i;
+
+    for (i = 0; i < priv->segments->len; i++) {
+        HttpSegment *seg = priv->segments->pdata[i];
+
+        if (seg->pos <= seg->end) {
+            fastest = MAX (fastest, http_segment_get_rate (seg));
+        }
+    }
+
+    return rate * HTTP_DOWNLOAD_SLOW_FACTOR < fastest;
+}
+
+static void
+http_download_segment_done (CURL *curl, CURLcode res, HttpSegment *seg)
+{
+    HttpDownload *self = seg->self;
+    HttpDownloadPrivate *priv = self->priv;
+
+    disk_stream_close (seg->out);
+    seg->out = NULL;
+
+    // A connection done with its range takes over work from the slowest one
+    if (seg->pos > seg->end && priv->state == DOWNLOAD_STATE_RUNNING &&
+        !disk_file_has_error (priv->file) &&
+        transfer_engine_is_running (transfer_engine_get_default ())) {
+        gdouble rate = http_segment_get_rate (seg);
+
+        if (!http_download_is_slow (self, rate) && http_download_steal (self, curl, rate)) {
+            seg->curl = NULL;
+            priv->active--;
+            return;
+        }
+    }
+
+    // Each range resumes on its own, a dropped connection only
+    // refetches what that segment is still missing
+    if (seg->pos <= seg->end && priv->state == DOWNLOAD_STATE_RUNNING &&
+        res != CURLE_ABORTED_BY_CALLBACK && !disk_file_has_error (priv->file) &&
+        seg->retries++ < HTTP_DOWNLOAD_SEGMENT_RETRIES) {
+        http_download_segment_add (self, seg);
+        return;
+    }
+
+    transfer_engine_release_handle (transfer_engine_get_default (), seg->curl);
+    seg->curl = NULL;
+
+    if (--priv->active == 0) {
+        http_download_finish_segments (self, res);
+    }
+}
+
+static void
+http_download_finish_segments (HttpDownload *self, CURLcode res)
+{
+    HttpDownloadPrivate *priv = self->priv;
+    gboolean done = TRUE;
+    gint i;
+
+    for (i = 0; i < priv->segments->len; i++) {
+        HttpSegment *seg = priv->segments->pdata[i];
+
+        if (seg->pos <= seg->end) {
+            done = FALSE;
+        }
+    }
+
+    // Segments that gave up on their range may still have ended cleanly
+    if (done) {
+        res = CURLE_OK;
+    } else if (res == CURLE_OK) {
+        res = CURLE_PARTIAL_FILE;
+    }
+
+    // Every segment closed its stream, the file is done once those are written
+    priv->result = res;
+    disk_file_finish (priv->file, done,
+        (DiskFileDoneFunc) http_download_written, g_object_ref (self));
+
+    disk_file_unref (priv->file);
+    priv->file = NULL;
 }
@@ -25,6 +25,7 @@
 #include <glib-object.h>
 
 #include "download.h"
+#include "download-registry.h"
 
 #define HTTP_DOWNLOAD_TYPE (http_download_get_type ())
 #define HTTP_DOWNLOAD(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), HTTP_DOWNLOAD_TYPE, HttpDownload))
@@ -33,6 +34,9 @@
 #define IS_HTTP_DOWNLOAD_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), HTTP_DOWNLOAD_TYPE))
 #define HTTP_DOWNLOAD_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), HTTP_DOWNLOAD_TYPE, HttpDownloadClass))
 
+// Saved state is keyed <id>.http
+#define HTTP_DOWNLOAD_TAG "http"
+
 G_BEGIN_DECLS
 
 typedef struct _HttpDownload HttpDownload;
@@ -50,7 +54,8 @@ struct _HttpDownloadClass {
 };
 
 Download *http_download_new (const gchar *source, const gchar *dest, gboolean nohead);
-Download *http_download_new_from_file (const gchar *filename);
+Download *http_download_new_from_data (const gchar *key, const gchar *data, gsize len);
+void http_download_register (DownloadRegistry *registry);
 
 GType http_download_get_type (void);
 
@@ -19,7 +19,16 @@
  *      MA 02110-1301, USA.
  */
 
+#include <string.h>
+
+#include <glib/gstdio.h>
+
+#ifdef GDMAN_HEADLESS
+#include <signal.h>
+#include <glib-unix.h>
+#else
 #include <gtk/gtk.h>
+#endif
 
 #include <dbus/dbus.h>
 #include <dbus/dbus-glib-lowlevel.h>
@@ -31,13 +40,54 @@
 
 #include "download.h"
 #include "download-group.h"
+#include "download-registry.h"
+#include "transfer-engine.h"
+#include "disk-writer.h"
+#include "state-store.h"
+#include "rate-limiter.h"
+
 #include "http-download.h"
 #include "megaupload-download.h"
 #include "youtube-download.h"
 
 G_DEFINE_TYPE(Manager, manager, G_TYPE_OBJECT)
 
+// Restored downloads are added to the main loop this many at a time
+#define MANAGER_LOAD_BATCH 100
+
+// Download types registered at startup, a new type only adds a line here
+static const DownloadRegisterFunc manager_download_types[] = {
+    http_download_register,
+    megaupload_download_register,
+    youtube_download_register,
+    NULL,
+};
+
+// Shortest progress interval a subscriber may ask for, in milliseconds
+#define MANAGER_PROGRESS_MIN_INTERVAL 100
+
+#ifndef GDMAN_HEADLESS
+// How often rows touched by transfer threads are redrawn, in milliseconds
+#define MANAGER_REFRESH_INTERVAL 200
+
+typedef struct _ManagerRow ManagerRow;
+struct _ManagerRow {
+    Manager *manager;
+    Download *download;
+    GtkTreeRowReference *ref;
+
+    // Set by whoever pushes the row on the dirty stack, cleared by the flush
+    volatile gint dirty;
+    ManagerRow *next;
+
+    gboolean removed;
+};
+#endif
+
 struct _ManagerPrivate {
+#ifdef GDMAN_HEADLESS
+    GMainLoop *loop;
+#else
     GtkBuilder *builder;
 
     GtkWidget *window;
@@ -46,11 +96,30 @@ struct _ManagerPrivate {
 
     GtkTreeModel *store;
 
+    // Download* -> ManagerRow of its row in store
+    GHashTable *rows;
+
+    // Lock-free stack of rows waiting to be redrawn
+    ManagerRow * volatile dirty;
+    guint refresh;
+
     GtkStatusIcon *icon;
+#endif
+
+    // Every download known to the manager, in display order
+    GPtrArray *downloads;
+
+    // Thread restoring saved downloads, told to stop early on exit
+    GThread *loader;
+    volatile gint load_cancel;
 
     DBusGConnection *conn;
     DBusGProxy *proxy;
 
+    // Download* -> ident, bus name -> ManagerSubscriber
+    GHashTable *idents;
+    GHashTable *subscribers;
+
     guint new_id;
     DownloadGroup *group;
 };
@@ -59,15 +128,39 @@ static Manager *instance = NULL;
 
 static guint signal_add;
 static guint signal_remove;
+static guint signal_state;
+
+typedef struct _ManagerSubscriber ManagerSubscriber;
+struct _ManagerSubscriber {
+    Manager *manager;
+    gchar *name;
+    guint source;
+};
+
+typedef struct _ManagerStateChange ManagerStateChange;
+struct _ManagerStateChange {
+    Manager *manager;
+    Download *download;
+    gint state;
+};
+
+static void download_state_saved (Download *download, gint state, Manager *self);
+static void download_state_notify (Download *download, gint state, Manager *self);
+static void manager_subscriber_free (ManagerSubscriber *sub);
+static void manager_name_owner_changed (DBusGProxy *proxy, const gchar *name,
+    const gchar *old_owner, const gchar *new_owner, Manager *self);
 
-static void download_pos_changed (Download *download, Manager *self);
-static void download_state_changed (Download *download, gint state, Manager *self);
+#ifndef GDMAN_HEADLESS
+static void download_pos_changed (Download *download, ManagerRow *row);
+static void download_state_changed (Download *download, gint state, ManagerRow *row);
+static gboolean manager_flush_rows (Manager *self);
 static void progress_column_func (GtkTreeViewColumn *column, GtkCellRenderer *cell,
     GtkTreeModel *model, GtkTreeIter *iter, gchar *data);
 static void title_column_func (GtkTreeViewColumn *column, GtkCellRenderer *cell,
     GtkTreeModel *model, GtkTreeIter *iter, gchar *data);
 static void time_column_func (GtkTreeViewColumn *column, GtkCellRenderer *cell,
     GtkTreeModel *model, GtkTreeIter *iter, gchar *data);
+#endif
 
 static void
 manager_finalize (GObject *object)
@@ -87,7 +180,7 @@ manager_class_init (ManagerClass *klass)
 
     object_class->finalize = manager_finalize;
 
-    signal_add = g_signal_new ("add-entry", G_TYPE_FROM_CLASS (klass),
+    signal_add = g_signal_new ("entry-added", G_TYPE_FROM_CLASS (klass),
         G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT,
         G_TYPE_NONE, 1, G_TYPE_UINT);
 
@@ -95,6 +188,10 @@ manager_class_init (ManagerClass *klass)
         G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT,
         G_TYPE_NONE, 1, G_TYPE_UINT);
 
+    signal_state = g_signal_new ("state-changed", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+        G_TYPE_NONE, 2, G_TYPE_UINT, G_TYPE_INT);
+
     dbus_g_object_type_install_info (MANAGER_TYPE,
                                      &dbus_glib_manager_object_info);
 }
@@ -104,6 +201,11 @@ manager_init (Manager *self)
 {
     self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), MANAGER_TYPE, ManagerPrivate);
 
+    self->priv->downloads = g_ptr_array_new ();
+
+#ifdef GDMAN_HEADLESS
+    self->priv->loop = g_main_loop_new (NULL, FALSE);
+#else
     self->priv->builder = gtk_builder_new ();
     gtk_builder_add_from_file (self->priv->builder,
         SHARE_DIR "/ui/main.ui", NULL);
@@ -113,6 +215,10 @@ manager_init (Manager *self)
     self->priv->status = GTK_WIDGET (gtk_builder_get_object (self->priv->builder, "main_status"));
 
     self->priv->store = GTK_TREE_MODEL (gtk_list_store_new (1, G_TYPE_OBJECT));
+    self->priv->rows = g_hash_table_new (g_direct_hash, g_direct_equal);
+    self->priv->dirty = NULL;
+    self->priv->refresh = gdk_threads_add_timeout (MANAGER_REFRESH_INTERVAL,
+        (GSourceFunc) manager_flush_rows, self);
     gtk_tree_view_set_model (GTK_TREE_VIEW (self->priv->view), self->priv->store);
 
     GtkCellRenderer *renderer;
@@ -142,8 +248,15 @@ manager_init (Manager *self)
     self->priv->icon = gtk_status_icon_new_from_stock (GTK_STOCK_GO_DOWN);
 
     gtk_widget_show_all (self->priv->window);
+#endif
 
     self->priv->new_id = 1;
+    self->priv->idents = g_hash_table_new (g_direct_hash, g_direct_equal);
+    self->priv->subscribers = g_hash_table_new_full (g_str_hash, g_str_equal,
+        NULL, (GDestroyNotify) manager_subscriber_free);
+
+    // Before anything can create or load a download
+    download_registry_add_types (download_registry_get_default (), manager_download_types);
 
     self->priv->group = download_group_new ("Primary");
 
@@ -151,6 +264,12 @@ manager_init (Manager *self)
     self->priv->proxy = dbus_g_proxy_new_for_name (self->priv->conn,
         DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS);
 
+    // Subscribers leaving the bus stop receiving progress
+    dbus_g_proxy_add_signal (self->priv->proxy, "NameOwnerChanged",
+        G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INVALID);
+    dbus_g_proxy_connect_signal (self->priv->proxy, "NameOwnerChanged",
+        G_CALLBACK (manager_name_owner_changed), self, NULL);
+
     org_freedesktop_DBus_request_name (self->priv->proxy,
         MANAGER_DBUS_SERVICE, DBUS_NAME_FLAG_DO_NOT_QUEUE, NULL, NULL);
 
@@ -169,6 +288,29 @@ manager_new ()
     return instance;
 }
 
+#ifdef GDMAN_HEADLESS
+static gboolean
+manager_quit_signal (Manager *self)
+{
+    manager_stop (self);
+    return FALSE;
+}
+
+void
+manager_run (Manager *self)
+{
+    g_unix_signal_add (SIGINT, (GSourceFunc) manager_quit_signal, self);
+    g_unix_signal_add (SIGTERM, (GSourceFunc) manager_quit_signal, self);
+
+    g_main_loop_run (self->priv->loop);
+}
+
+void
+manager_stop (Manager *self)
+{
+    g_main_loop_quit (self->priv->loop);
+}
+#else
 void
 manager_run (Manager *self)
 {
@@ -182,154 +324,666 @@ manager_stop (Manager *self)
 {
     gtk_main_quit ();
 }
+#endif
+
+/*
+ * Returns the host part of url, without the port, or NULL for urls that no
+ * download type handles.
+ */
+static gchar*
+manager_get_host (const gchar *url)
+{
+    return download_registry_get_host (download_registry_get_default (), url);
+}
+
+static Download*
+manager_new_download (const gchar *url, const gchar *dest, const gchar *host)
+{
+    return download_registry_create (download_registry_get_default (), url, dest, host);
+}
+
+/*
+ * Detach the model while many rows are appended, the view then catches up
+ * once instead of after every row.
+ */
+static void
+manager_freeze_view (Manager *self)
+{
+#ifndef GDMAN_HEADLESS
+    gtk_tree_view_set_model (GTK_TREE_VIEW (self->priv->view), NULL);
+#endif
+}
+
+static void
+manager_thaw_view (Manager *self)
+{
+#ifndef GDMAN_HEADLESS
+    gtk_tree_view_set_model (GTK_TREE_VIEW (self->priv->view), self->priv->store);
+#endif
+}
 
 gboolean
 manager_create_download (Manager *self, gchar *url, gchar *dest)
 {
-    if (g_str_has_prefix (url, "http://")) {
-        gchar **str1 = g_strsplit (url+7, "/", 2);
-        gchar **str2 = g_strsplit (str1[0], ":", 2);
+    gchar *host = manager_get_host (url);
 
-        Download *d = NULL;
-        if (!g_strcmp0 (str2[0], "www.megaupload.com")) {
-            d = megaupload_download_new (url, dest);
-        } else if (!g_strcmp0 (str2[0], "www.youtube.com")) {
-            d = youtube_download_new (url, dest);
-        } else {
-            d = http_download_new (url, dest, FALSE);
-        }
+    if (host) {
+        Download *d = manager_new_download (url, dest, host);
 
         if (d) {
+            // Queueing saves it right away, so a crash can still find it
+            // and its journal
             manager_display_download (self, d);
             download_queue (d);
+
+            download_group_add (self->priv->group, d, host);
             download_group_queue (self->priv->group, d);
         }
 
-        g_strfreev (str1);
-        g_strfreev (str2);
+        g_free (host);
     }
 }
 
-gboolean
-manager_load_downloads (Manager *self)
+/*
+ * Older versions kept one key file per download in the config directory,
+ * move them into the state store and remove them once it is on disk.
+ */
+static void
+manager_migrate_downloads (Manager *self)
 {
-    gchar *str = g_strdup_printf ("%s/gdman", g_get_user_config_dir ());
+    StateStore *store = state_store_get_default ();
+    DownloadRegistry *registry = download_registry_get_default ();
+    gchar *str = g_build_filename (g_get_user_config_dir (), "gdman", NULL);
+    GSList *migrated = NULL, *iter;
+    const gchar *filename;
 
     GDir *dir = g_dir_open (str, 0, NULL);
     if (!dir) {
         g_free (str);
-        return FALSE;
+        return;
     }
 
-    const gchar *filename;
+    while (filename = g_dir_read_name (dir)) {
+        gchar *path, *data;
+        gsize len;
+
+        if (!download_registry_has_key (registry, filename)) {
+            continue;
+        }
+
+        path = g_build_filename (str, filename, NULL);
+
+        if (g_file_get_contents (path, &data, &len, NULL)) {
+            state_store_put (store, filename, data, len);
+            migrated = g_slist_prepend (migrated, path);
+            g_free (data);
+        } else {
+            g_free (path);
+        }
+    }
+
+    g_dir_close (dir);
+    g_free (str);
+
+    if (migrated) {
+        state_store_sync (store);
+    }
+
+    for (iter = migrated; iter; iter = iter->next) {
+        g_unlink (iter->data);
+        g_free (iter->data);
+    }
+
+    g_slist_free (migrated);
+}
+
+typedef struct _ManagerLoader ManagerLoader;
+struct _ManagerLoader {
+    Manager *manager;
+    GPtrArray *batch;
+};
+
+static gboolean
+manager_load_batch (GPtrArray *batch)
+{
+    Manager *self = instance;
+    GPtrArray *hosts = g_ptr_array_sized_new (batch->len);
     gint i;
 
-    while (filename = g_dir_read_name (dir)) {
-        g_print ("FILE: %s\n", filename);
+    manager_freeze_view (self);
+
+    for (i = 0; i < batch->len; i++) {
+        Download *d = batch->pdata[i];
+
+        manager_display_download (self, d);
+        g_ptr_array_add (hosts, manager_get_host (download_get_source (d)));
+    }
+
+    manager_thaw_view (self);
+
+    download_group_queue_all (self->priv->group, batch, hosts);
+
+    g_ptr_array_foreach (hosts, (GFunc) g_free, NULL);
+    g_ptr_array_free (hosts, TRUE);
+
+    g_ptr_array_foreach (batch, (GFunc) g_object_unref, NULL);
+    g_ptr_array_free (batch, TRUE);
+
+    return FALSE;
+}
+
+static void
+manager_load_flush (ManagerLoader *loader)
+{
+    if (loader->batch->len == 0) {
+        return;
+    }
 
-        i = strlen (filename);
-        while (filename[--i] != '.');
+#ifdef GDMAN_HEADLESS
+    g_idle_add ((GSourceFunc) manager_load_batch, loader->batch);
+#else
+    gdk_threads_add_idle ((GSourceFunc) manager_load_batch, loader->batch);
+#endif
 
-        const gchar *ext = filename+i+1;
+    loader->batch = g_ptr_array_sized_new (MANAGER_LOAD_BATCH);
+}
+
+static void
+manager_load_download (const gchar *key, const gchar *data, gsize len, ManagerLoader *loader)
+{
+    Download *d;
 
-        g_print ("Ext: %s\n", ext);
+    if (g_atomic_int_get (&loader->manager->priv->load_cancel)) {
+        return;
+    }
 
-        gchar *path = g_build_filename (str, filename, NULL);
+    // Migrated keys keep the old file name, either way the extension
+    // names the type and the download saves back under the same key
+    d = download_registry_load (download_registry_get_default (), key, data, len);
 
-        g_print ("Path: %s\n", path);
+    if (d) {
+        g_ptr_array_add (loader->batch, d);
 
-        Download *d = NULL;
-        if (!g_strcmp0 (ext, "youtube")) {
-            d = youtube_download_new_from_file (path);
-        } else if (!g_strcmp0 (ext, "megaupload")) {
-            d = megaupload_download_new_from_file (path);
-        } else if (!g_strcmp0 (ext, "http")) {
-            d = http_download_new_from_file (path);
+        if (loader->batch->len == MANAGER_LOAD_BATCH) {
+            manager_load_flush (loader);
         }
+    }
+}
+
+static gpointer
+manager_load_main (Manager *self)
+{
+    ManagerLoader loader;
+
+    loader.manager = self;
+    loader.batch = g_ptr_array_sized_new (MANAGER_LOAD_BATCH);
+
+    manager_migrate_downloads (self);
+
+    state_store_foreach (state_store_get_default (),
+        (StateStoreFunc) manager_load_download, &loader);
+
+    manager_load_flush (&loader);
+    g_ptr_array_free (loader.batch, TRUE);
+
+    return NULL;
+}
+
+/*
+ * Saved downloads are read and parsed in a loader thread, the main loop only
+ * adds them in small batches so the window is usable from the start.
+ */
+gboolean
+manager_load_downloads (Manager *self)
+{
+    self->priv->load_cancel = FALSE;
+    self->priv->loader = g_thread_create ((GThreadFunc) manager_load_main,
+        self, TRUE, NULL);
+
+    return self->priv->loader != NULL;
+}
+
+gboolean
+manager_add_download (Manager *self, gchar *url, gchar *dest, guint *ident, GError **error)
+{
+    g_print ("Manager Add Download %s -> %s\n", url, dest);
+
+    // The download takes the next ident when it is displayed
+    *ident = self->priv->new_id;
+
+    manager_create_download (self, url, dest);
+
+    if (self->priv->new_id == *ident) {
+        self->priv->new_id++;
+    }
+
+    return TRUE;
+}
+
+gboolean
+manager_add_downloads (Manager *self, GPtrArray *downloads, GArray **idents, GError **error)
+{
+    GPtrArray *added = g_ptr_array_sized_new (downloads->len);
+    GPtrArray *hosts = g_ptr_array_sized_new (downloads->len);
+    gint i;
+
+    *idents = g_array_sized_new (FALSE, FALSE, sizeof (guint), downloads->len);
+
+    manager_freeze_view (self);
+
+    for (i = 0; i < downloads->len; i++) {
+        GValueArray *entry = downloads->pdata[i];
+        const gchar *url = g_value_get_string (g_value_array_get_nth (entry, 0));
+        const gchar *dest = g_value_get_string (g_value_array_get_nth (entry, 1));
+
+        guint ident = self->priv->new_id;
+        g_array_append_val (*idents, ident);
+
+        gchar *host = manager_get_host (url);
+        Download *d = host ? manager_new_download (url, dest, host) : NULL;
 
         if (d) {
             manager_display_download (self, d);
-            download_group_queue (self->priv->group, d);
+            download_queue (d);
+
+            g_ptr_array_add (added, d);
+            g_ptr_array_add (hosts, host);
+        } else {
+            self->priv->new_id++;
+            g_free (host);
         }
+    }
+
+    manager_thaw_view (self);
+
+    // One pass through the scheduler for the whole batch
+    download_group_queue_all (self->priv->group, added, hosts);
 
-        g_free (path);
+    g_ptr_array_foreach (hosts, (GFunc) g_free, NULL);
+    g_ptr_array_free (hosts, TRUE);
+    g_ptr_array_free (added, TRUE);
+
+    return TRUE;
+}
+
+static void
+download_state_saved (Download *download, gint state, Manager *self)
+{
+    // Every state change is appended to the state store as it happens
+    download_export_to_file (download);
+}
+
+static gboolean
+manager_emit_state (ManagerStateChange *change)
+{
+    Manager *self = change->manager;
+    gpointer ident;
+
+    if (g_hash_table_lookup_extended (self->priv->idents, change->download, NULL, &ident)) {
+        g_signal_emit (self, signal_state, 0, GPOINTER_TO_UINT (ident), change->state);
     }
 
-    g_free (str);
+    g_object_unref (change->download);
+    g_free (change);
+
+    return FALSE;
+}
+
+static void
+download_state_notify (Download *download, gint state, Manager *self)
+{
+    ManagerStateChange *change = g_new0 (ManagerStateChange, 1);
+
+    // Changes come from the transfer threads, the bus is used from the
+    // main loop only
+    change->manager = self;
+    change->download = g_object_ref (download);
+    change->state = state;
+
+    g_idle_add ((GSourceFunc) manager_emit_state, change);
+}
+
+static void
+manager_subscriber_free (ManagerSubscriber *sub)
+{
+    g_source_remove (sub->source);
+    g_free (sub->name);
+    g_free (sub);
+}
+
+/*
+ * Send sub one batched progress signal holding every running download. It
+ * goes to that subscriber only, so each one gets its own rate.
+ */
+static gboolean
+manager_send_progress (ManagerSubscriber *sub)
+{
+    Manager *self = sub->manager;
+    DBusMessageIter iter, array, entry;
+    gint i, count = 0;
+
+    DBusMessage *msg = dbus_message_new_signal (MANAGER_DBUS_PATH,
+        MANAGER_DBUS_INTERFACE, "progress");
+    dbus_message_set_destination (msg, sub->name);
+
+    dbus_message_iter_init_append (msg, &iter);
+    dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(utt)", &array);
+
+    for (i = 0; i < self->priv->downloads->len; i++) {
+        Download *d = self->priv->downloads->pdata[i];
+
+        if (download_get_state (d) != DOWNLOAD_STATE_RUNNING) {
+            continue;
+        }
+
+        guint32 ident = GPOINTER_TO_UINT (g_hash_table_lookup (self->priv->idents, d));
+        guint64 completed = download_get_size_completed (d);
+        guint64 total = download_get_size_total (d);
+
+        dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT, NULL, &entry);
+        dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT32, &ident);
+        dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT64, &completed);
+        dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT64, &total);
+        dbus_message_iter_close_container (&array, &entry);
+
+        count++;
+    }
+
+    dbus_message_iter_close_container (&iter, &array);
+
+    if (count > 0) {
+        dbus_connection_send (dbus_g_connection_get_connection (self->priv->conn), msg, NULL);
+    }
+
+    dbus_message_unref (msg);
+
+    return TRUE;
 }
 
 gboolean
-manager_add_download (Manager *self, gchar *url, gchar *dest, guint *ident, GError **error)
+manager_subscribe_progress (Manager *self, guint interval, DBusGMethodInvocation *context)
 {
-    g_print ("Manager Add Download %s -> %s\n", url, dest);
+    gchar *name = dbus_g_method_get_sender (context);
 
-    *ident = self->priv->new_id++;
+    g_hash_table_remove (self->priv->subscribers, name);
 
-    manager_create_download (self, url, dest);
+    if (interval > 0) {
+        ManagerSubscriber *sub = g_new0 (ManagerSubscriber, 1);
+
+        sub->manager = self;
+        sub->name = name;
+        sub->source = g_timeout_add (MAX (interval, MANAGER_PROGRESS_MIN_INTERVAL),
+            (GSourceFunc) manager_send_progress, sub);
+
+        g_hash_table_insert (self->priv->subscribers, sub->name, sub);
+    } else {
+        g_free (name);
+    }
+
+    dbus_g_method_return (context);
 
     return TRUE;
 }
 
 gboolean
-manager_display_download (Manager *self, Download *download)
+manager_set_rate_limit (Manager *self, guint64 rate, GError **error)
 {
-    GtkTreeIter iter;
-    gtk_list_store_append (GTK_LIST_STORE (self->priv->store), &iter);
-    gtk_list_store_set (GTK_LIST_STORE (self->priv->store), &iter, 0, download, -1);
-    g_signal_connect (download, "state-changed", G_CALLBACK (download_state_changed), self);
-    g_signal_connect (download, "position-changed", G_CALLBACK (download_pos_changed), self);
+    RateLimiter *limiter = rate_limiter_get_default ();
+
+    rate_limiter_set_rate (limiter, rate_limiter_get_global (limiter), rate);
+
+    return TRUE;
+}
+
+static gboolean
+manager_check_group (Manager *self, const gchar *group, GError **error)
+{
+    if (g_strcmp0 (group, download_group_get_name (self->priv->group))) {
+        g_set_error (error, DBUS_GERROR, DBUS_GERROR_INVALID_ARGS,
+            "Unknown group %s", group);
+        return FALSE;
+    }
+
+    return TRUE;
 }
 
 gboolean
-manager_remove_download (Manager *self, Download *download)
+manager_set_group_rate_limit (Manager *self, gchar *group, guint64 rate, GError **error)
+{
+    if (!manager_check_group (self, group, error)) {
+        return FALSE;
+    }
+
+    download_group_set_rate_limit (self->priv->group, rate);
+
+    return TRUE;
+}
+
+gboolean
+manager_set_max_active (Manager *self, gchar *group, guint max, GError **error)
+{
+    if (!manager_check_group (self, group, error)) {
+        return FALSE;
+    }
+
+    download_group_set_max_active (self->priv->group, MIN (max, G_MAXINT));
+
+    return TRUE;
+}
+
+gboolean
+manager_set_max_per_host (Manager *self, gchar *group, guint max, GError **error)
 {
+    if (!manager_check_group (self, group, error)) {
+        return FALSE;
+    }
+
+    download_group_set_max_per_host (self->priv->group, MIN (max, G_MAXINT));
+
+    return TRUE;
+}
+
+static Download*
+manager_find_download (Manager *self, guint ident, GError **error)
+{
+    GHashTableIter iter;
+    gpointer download, value;
+
+    g_hash_table_iter_init (&iter, self->priv->idents);
+    while (g_hash_table_iter_next (&iter, &download, &value)) {
+        if (GPOINTER_TO_UINT (value) == ident) {
+            return download;
+        }
+    }
+
+    g_set_error (error, DBUS_GERROR, DBUS_GERROR_INVALID_ARGS,
+        "Unknown download %u", ident);
 
+    return NULL;
+}
+
+gboolean
+manager_set_download_rate_limit (Manager *self, guint ident, guint64 rate, GError **error)
+{
+    Download *download = manager_find_download (self, ident, error);
+
+    if (!download) {
+        return FALSE;
+    }
+
+    rate_limiter_set_download_rate (rate_limiter_get_default (), download, rate);
+
+    return TRUE;
+}
+
+gboolean
+manager_remove_download_by_ident (Manager *self, guint ident, GError **error)
+{
+    Download *download = manager_find_download (self, ident, error);
+
+    return download && manager_remove_download (self, download);
 }
 
 static void
-download_pos_changed (Download *download, Manager *self)
+manager_name_owner_changed (DBusGProxy *proxy, const gchar *name,
+    const gchar *old_owner, const gchar *new_owner, Manager *self)
 {
-    gdk_threads_enter ();
+    if (!new_owner || new_owner[0] == '\0') {
+        g_hash_table_remove (self->priv->subscribers, name);
+    }
+}
+
+gboolean
+manager_display_download (Manager *self, Download *download)
+{
+    guint ident = self->priv->new_id++;
+
+    g_ptr_array_add (self->priv->downloads, g_object_ref (download));
+    g_hash_table_insert (self->priv->idents, download, GUINT_TO_POINTER (ident));
+
+    g_signal_connect (download, "state-changed", G_CALLBACK (download_state_saved), self);
+    g_signal_connect (download, "state-changed", G_CALLBACK (download_state_notify), self);
+
+    g_signal_emit (self, signal_add, 0, ident);
+
+#ifndef GDMAN_HEADLESS
     GtkTreeIter iter;
-    Download *d;
+    gtk_list_store_append (GTK_LIST_STORE (self->priv->store), &iter);
+    gtk_list_store_set (GTK_LIST_STORE (self->priv->store), &iter, 0, download, -1);
+
+    ManagerRow *row = g_new0 (ManagerRow, 1);
+    row->manager = self;
+    row->download = download;
 
-    if (!gtk_tree_model_get_iter_first (self->priv->store, &iter)) {
+    GtkTreePath *path = gtk_tree_model_get_path (self->priv->store, &iter);
+    row->ref = gtk_tree_row_reference_new (self->priv->store, path);
+    gtk_tree_path_free (path);
+
+    g_hash_table_insert (self->priv->rows, download, row);
+
+    g_signal_connect (download, "state-changed", G_CALLBACK (download_state_changed), row);
+    g_signal_connect (download, "position-changed", G_CALLBACK (download_pos_changed), row);
+#endif
+
+    return TRUE;
+}
+
+#ifndef GDMAN_HEADLESS
+/*
+ * Push row on the dirty stack unless it is already there. Safe to call from
+ * any thread, never blocks.
+ */
+static void
+manager_mark_row (Manager *self, ManagerRow *row)
+{
+    ManagerRow *head;
+
+    if (!g_atomic_int_compare_and_exchange (&row->dirty, 0, 1)) {
         return;
     }
 
     do {
-        gtk_tree_model_get (self->priv->store, &iter, 0, &d, -1);
-        if (d == download) {
-            GtkTreePath *path = gtk_tree_model_get_path (self->priv->store, &iter);
-            gtk_tree_model_row_changed (self->priv->store, path, &iter);
-            gtk_tree_path_free (path);
-            break;
-        }
-    } while (gtk_tree_model_iter_next (self->priv->store, &iter));
-    gdk_threads_leave ();
+        head = g_atomic_pointer_get (&self->priv->dirty);
+        row->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange (&self->priv->dirty, head, row));
 }
+#endif
+
+gboolean
+manager_remove_download (Manager *self, Download *download)
+{
+    if (!g_ptr_array_remove (self->priv->downloads, download)) {
+        return FALSE;
+    }
+
+    g_signal_handlers_disconnect_matched (download, G_SIGNAL_MATCH_DATA,
+        0, 0, NULL, NULL, self);
+    g_hash_table_remove (self->priv->idents, download);
+
+    // Pauses a running download, its transfers keep it alive until their
+    // done callbacks have run
+    download_group_remove (self->priv->group, download);
+
+    // No state change is saved from here on, drop the saved one
+    download_forget (download);
 
+#ifndef GDMAN_HEADLESS
+    ManagerRow *row = g_hash_table_lookup (self->priv->rows, download);
+    GtkTreeIter iter;
+
+    g_signal_handlers_disconnect_matched (download, G_SIGNAL_MATCH_DATA,
+        0, 0, NULL, NULL, row);
+
+    GtkTreePath *path = gtk_tree_row_reference_get_path (row->ref);
+    if (path && gtk_tree_model_get_iter (self->priv->store, &iter, path)) {
+        gtk_list_store_remove (GTK_LIST_STORE (self->priv->store), &iter);
+    }
+    gtk_tree_path_free (path);
+
+    g_hash_table_remove (self->priv->rows, download);
+
+    // A transfer thread may still hold the row, let the next flush free it
+    row->removed = TRUE;
+    manager_mark_row (self, row);
+#endif
+
+    g_object_unref (download);
+
+    return TRUE;
+}
+
+#ifndef GDMAN_HEADLESS
+/*
+ * Emit row-changed for the row showing download. Must be called with the
+ * gdk lock held.
+ */
 static void
-download_state_changed (Download *download, gint state, Manager *self)
+manager_update_row (Manager *self, ManagerRow *row)
 {
-    gdk_threads_enter ();
     GtkTreeIter iter;
-    Download *d;
 
-    if (!gtk_tree_model_get_iter_first (self->priv->store, &iter)) {
-        return;
+    GtkTreePath *path = gtk_tree_row_reference_get_path (row->ref);
+    if (path && gtk_tree_model_get_iter (self->priv->store, &iter, path)) {
+        gtk_tree_model_row_changed (self->priv->store, path, &iter);
     }
+    gtk_tree_path_free (path);
+}
+
+static gboolean
+manager_flush_rows (Manager *self)
+{
+    ManagerRow *row, *next;
 
     do {
-        gtk_tree_model_get (self->priv->store, &iter, 0, &d, -1);
-        if (d == download) {
-            GtkTreePath *path = gtk_tree_model_get_path (self->priv->store, &iter);
-            gtk_tree_model_row_changed (self->priv->store, path, &iter);
-            gtk_tree_path_free (path);
-            break;
+        row = g_atomic_pointer_get (&self->priv->dirty);
+    } while (!g_atomic_pointer_compare_and_exchange (&self->priv->dirty, row, NULL));
+
+    for (; row; row = next) {
+        next = row->next;
+
+        if (row->removed) {
+            gtk_tree_row_reference_free (row->ref);
+            g_free (row);
+            continue;
         }
-    } while (gtk_tree_model_iter_next (self->priv->store, &iter));
-    gdk_threads_leave ();
+
+        g_atomic_int_set (&row->dirty, 0);
+        manager_update_row (self, row);
+    }
+
+    return TRUE;
+}
+
+static void
+download_pos_changed (Download *download, ManagerRow *row)
+{
+    manager_mark_row (row->manager, row);
+}
+
+static void
+download_state_changed (Download *download, gint state, ManagerRow *row)
+{
+    manager_mark_row (row->manager, row);
 }
 
 static void
@@ -343,8 +997,8 @@ progress_column_func (GtkTreeViewColumn *column,
 
     gtk_tree_model_get (model, iter, 0, &d, -1);
     if (d) {
-        gint size = download_get_size_total (d);
-        gint comp = download_get_size_completed (d);
+        goffset size = download_get_size_total (d);
+        goffset comp = download_get_size_completed (d);
         if (size <= 0) {
             gint val;
             g_object_get (cell, "pulse", &val, NULL);
@@ -382,7 +1036,7 @@ title_column_func (GtkTreeViewColumn *column,
     gtk_tree_model_get (model, iter, 0, &d, -1);
     if (d) {
         gchar *title = download_get_title (d);
-        gint isize = download_get_size_total (d);
+        goffset isize = download_get_size_total (d);
         gchar *size = size_to_string (isize);
         gchar *comp = size_to_string (download_get_size_completed (d));
 
@@ -433,14 +1087,22 @@ time_column_func (GtkTreeViewColumn *column,
         g_object_set (G_OBJECT (cell), "text", "", NULL);
     }
 }
+#endif
 
 int
 main (int argc, char *argv[])
 {
+    gint i;
+
     g_thread_init (NULL);
+
+#ifdef GDMAN_HEADLESS
+    g_type_init ();
+#else
     gdk_threads_init ();
 
     gtk_init (&argc, &argv);
+#endif
 
     Manager *manager = manager_new ();
 
@@ -448,12 +1110,18 @@ main (int argc, char *argv[])
 
     manager_run (manager);
 
-    GtkTreeIter iter;
-    Download *d;
-    if (gtk_tree_model_get_iter_first (manager->priv->store, &iter)) {
-        do {
-            gtk_tree_model_get (manager->priv->store, &iter, 0, &d, -1);
-            download_export_to_file (d);
-        } while (gtk_tree_model_iter_next (manager->priv->store, &iter));
+    // Batches still waiting are simply left in the state store
+    g_atomic_int_set (&manager->priv->load_cancel, TRUE);
+    if (manager->priv->loader) {
+        g_thread_join (manager->priv->loader);
     }
+
+    transfer_engine_shutdown (transfer_engine_get_default ());
+    disk_writer_shutdown (disk_writer_get_default ());
+
+    for (i = 0; i < manager->priv->downloads->len; i++) {
+        download_export_to_file (DOWNLOAD (manager->priv->downloads->pdata[i]));
+    }
+
+    state_store_sync (state_store_get_default ());
 }
@@ -23,11 +23,13 @@
 #define __MANAGER_H__
 
 #include <glib-object.h>
+#include <dbus/dbus-glib.h>
 
 #include "download.h"
 
 #define MANAGER_DBUS_SERVICE "org.gnome.GDMan"
 #define MANAGER_DBUS_PATH "/org/gnome/GDMan/Manager"
+#define MANAGER_DBUS_INTERFACE "org.gnome.GDMan.Manager"
 
 #define MANAGER_TYPE (manager_get_type ())
 #define MANAGER(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), MANAGER_TYPE, Manager))
@@ -61,6 +63,15 @@ void manager_stop (Manager *self);
 
 gboolean manager_create_download (Manager *self, gchar *url, gchar *dest);
 gboolean manager_add_download (Manager *self, gchar *url, gchar *dest, guint *ident, GError **error);
+gboolean manager_add_downloads (Manager *self, GPtrArray *downloads, GArray **idents, GError **error);
+gboolean manager_subscribe_progress (Manager *self, guint interval, DBusGMethodInvocation *context);
+
+gboolean manager_set_rate_limit (Manager *self, guint64 rate, GError **error);
+gboolean manager_set_group_rate_limit (Manager *self, gchar *group, guint64 rate, GError **error);
+gboolean manager_set_download_rate_limit (Manager *self, guint ident, guint64 rate, GError **error);
+gboolean manager_remove_download_by_ident (Manager *self, guint ident, GError **error);
+gboolean manager_set_max_active (Manager *self, gchar *group, guint max, GError **error);
+gboolean manager_set_max_per_host (Manager *self, gchar *group, guint max, GError **error);
 gboolean manager_display_download (Manager *self, Download *download);
 gboolean manager_remove_download (Manager *self, Download *download);
 
@@ -19,17 +19,27 @@
  *      MA 02110-1301, USA.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 
+#include <glib/gstdio.h>
 #include <curl/curl.h>
 
+#ifndef GDMAN_HEADLESS
+#include <gtk/gtk.h>
+#endif
+
 #include "megaupload-download.h"
 
 #include "http-download.h"
+#include "disk-writer.h"
 #include "download.h"
+#include "rate-limiter.h"
+#include "state-store.h"
+#include "transfer-engine.h"
 
 static void download_init (DownloadInterface *iface);
 G_DEFINE_TYPE_WITH_CODE (MegauploadDownload, megaupload_download, G_TYPE_OBJECT,
@@ -44,6 +54,20 @@ enum {
     MEGAUPLOAD_STAGE_DFILE,
 };
 
+enum {
+    MEGAUPLOAD_SCAN_MARK = 0,
+    MEGAUPLOAD_SCAN_FORM,
+    MEGAUPLOAD_SCAN_LINK,
+    MEGAUPLOAD_SCAN_DONE,
+};
+
+#define MEGAUPLOAD_FORM_MARK "<FORM method=\"POST\" id=\"captchaform\">"
+#define MEGAUPLOAD_LINK_MARK "downloadlink"
+
+// The link starts past the rest of the tag and the anchor's href
+#define MEGAUPLOAD_LINK_OFFSET 11
+#define MEGAUPLOAD_MAX_LINK 4096
+
 typedef struct _MUCaptcha MUCaptcha;
 struct _MUCaptcha {
     gchar *captchacode;
@@ -55,22 +79,41 @@ struct _MUCaptcha {
 struct _MegauploadDownloadPrivate {
     gchar *source, *dest;
 
+    // Saved state record, named when the download is first created
+    gchar *key;
+
     CURL *curl;
-    FILE *fptr;
-    GThread *main;
+    DiskFile *file;
+    DiskStream *out;
+
+    // Pages are scanned as they stream in, token carries a marker split
+    // across chunks and then the link being read
+    GString *token;
+    const gchar *mark;
+    gint scan;
+    GMarkupParseContext *form;
+
+    // Captcha form post
+    gchar *post;
 
+#ifndef GDMAN_HEADLESS
     GdkPixbufLoader *img_loader;
+#endif
 
-    gint size, completed;
+    goffset size, completed;
     gint state, stage;
+
+    // How the file transfer ended, settled once the file is on disk
+    CURLcode result;
     time_t ot;
 
     MUCaptcha cap;
 };
 
 static gchar *megaupload_download_get_title (Download *self);
-static gint megaupload_download_get_size_total (Download *self);
-static gint megaupload_download_get_size_completed (Download *self);
+static const gchar *megaupload_download_get_source (Download *self);
+static goffset megaupload_download_get_size_total (Download *self);
+static goffset megaupload_download_get_size_completed (Download *self);
 static gint megaupload_download_get_time_total (Download *self);
 static gint megaupload_download_get_time_remaining (Download *self);
 static gboolean megaupload_download_get_state (Download *self);
@@ -80,13 +123,22 @@ static gboolean megaupload_download_stop (Download *self);
 static gboolean megaupload_download_cancel (Download *self);
 static gboolean megaupload_download_pause (Download *self);
 static gboolean megaupload_download_export_to_file (Download *self);
-
-gpointer megaupload_download_main (MegauploadDownload *self);
+static gboolean megaupload_download_forget (Download *self);
+
+static const gchar *megaupload_download_get_id (MegauploadDownload *self);
+static void megaupload_download_request_page (MegauploadDownload *self);
+static void megaupload_download_fetch_file (MegauploadDownload *self, const gchar *name);
+static void megaupload_download_first_done (CURL *curl, CURLcode res, MegauploadDownload *self);
+#ifndef GDMAN_HEADLESS
+static void megaupload_download_second_done (CURL *curl, CURLcode res, MegauploadDownload *self);
+static gboolean megaupload_download_ask_captcha (MegauploadDownload *self);
+#endif
+static void megaupload_download_third_done (CURL *curl, CURLcode res, MegauploadDownload *self);
+static void megaupload_download_file_done (CURL *curl, CURLcode res, MegauploadDownload *self);
+static void megaupload_download_written (gboolean ok, MegauploadDownload *self);
 int megaupload_download_progress (MegauploadDownload *self, gdouble dt, gdouble dn, gdouble ut, gdouble un);
 static size_t megaupload_download_write_data (char *buff, size_t size, size_t num, MegauploadDownload *self);
 
-static void megaupload_download_parse_captcha (gchar *filename, MUCaptcha *cap);
-
 static void megaupload_download_start_element (GMarkupParseContext *context,
     const gchar *element_name, const gchar **attribute_names,
     const gchar **attribute_values, gpointer user_data, GError **error);
@@ -95,6 +147,7 @@ static void
 download_init (DownloadInterface *iface)
 {
     iface->get_title = megaupload_download_get_title;
+    iface->get_source = megaupload_download_get_source;
 
     iface->get_size_tot = megaupload_download_get_size_total;
     iface->get_size_comp = megaupload_download_get_size_completed;
@@ -111,6 +164,7 @@ download_init (DownloadInterface *iface)
     iface->pause = megaupload_download_pause;
 
     iface->export = megaupload_download_export_to_file;
+    iface->forget = megaupload_download_forget;
 }
 
 static void
@@ -118,6 +172,9 @@ megaupload_download_finalize (GObject *object)
 {
     MegauploadDownload *self = MEGAUPLOAD_DOWNLOAD (object);
 
+    g_free (self->priv->key);
+    g_string_free (self->priv->token, TRUE);
+
     G_OBJECT_CLASS (megaupload_download_parent_class)->finalize (object);
 }
 
@@ -136,6 +193,16 @@ static void
 megaupload_download_init (MegauploadDownload *self)
 {
     self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), MEGAUPLOAD_DOWNLOAD_TYPE, MegauploadDownloadPrivate);
+
+    self->priv->token = g_string_new (NULL);
+}
+
+void
+megaupload_download_register (DownloadRegistry *registry)
+{
+    download_registry_add_type (registry, MEGAUPLOAD_DOWNLOAD_TAG,
+        megaupload_download_new, megaupload_download_new_from_data);
+    download_registry_add_host (registry, ".megaupload.com", MEGAUPLOAD_DOWNLOAD_TAG);
 }
 
 Download*
@@ -145,31 +212,35 @@ megaupload_download_new (const gchar *source, const gchar *dest)
 
     self->priv->source = g_strdup (source);
     self->priv->dest = g_strdup (dest);
+    self->priv->key = _download_make_key (source, dest, MEGAUPLOAD_DOWNLOAD_TAG);
 
     return DOWNLOAD (self);
 }
 
 Download*
-megaupload_download_new_from_file (const gchar *filename)
+megaupload_download_new_from_data (const gchar *key, const gchar *data, gsize len)
 {
     GError *err = NULL;
     GKeyFile *kf = g_key_file_new ();
 
     MegauploadDownload *self = g_object_new (MEGAUPLOAD_DOWNLOAD_TYPE, NULL);
 
-    g_key_file_load_from_file (kf, filename, G_KEY_FILE_NONE, &err);
+    g_key_file_load_from_data (kf, data, len, G_KEY_FILE_NONE, &err);
 
     if (err) {
-        g_print ("Error loading %s: %s\n", filename, err->message);
+        g_print ("Error loading download: %s\n", err->message);
         g_error_free (err);
         err = NULL;
     }
 
+    self->priv->key = g_strdup (key);
     self->priv->source = g_key_file_get_string (kf, "Download", "Source", NULL);
     self->priv->dest = g_key_file_get_string (kf, "Download", "Destination", NULL);
     self->priv->state = g_key_file_get_integer (kf, "Download", "State", NULL);
-    self->priv->size = g_key_file_get_integer (kf, "Dowload", "Size", NULL);
-    self->priv->completed = g_key_file_get_integer (kf, "Download", "Completed", NULL);
+    self->priv->size = g_key_file_get_int64 (kf, "Download", "Size", NULL);
+    self->priv->completed = g_key_file_get_int64 (kf, "Download", "Completed", NULL);
+
+    g_key_file_free (kf);
 
     return DOWNLOAD (self);
 }
@@ -178,35 +249,28 @@ static gboolean
 megaupload_download_export_to_file (Download *self)
 {
     MegauploadDownloadPrivate *priv = MEGAUPLOAD_DOWNLOAD (self)->priv;
-    gint i = strlen (priv->source);
-    while (priv->source[i--] != '=');
-
-    gchar *str = g_strdup_printf ("%s/gdman/%s.megaupload", g_get_user_config_dir (), priv->source+i+2);
-    FILE *fptr = fopen (str, "w");
-    g_free (str);
 
-    gchar *group = "[Download]\n";
-    fwrite (group, 1, strlen (group), fptr);
+    GString *str = g_string_new ("[Download]\n");
 
-    fwrite ("Source=", 1, 7, fptr);
-    fwrite (priv->source, 1, strlen (priv->source), fptr);
+    g_string_append_printf (str, "Source=%s\n", priv->source);
+    g_string_append_printf (str, "Destination=%s\n", priv->dest);
+    g_string_append_printf (str, "State=%d\n", priv->state);
+    g_string_append_printf (str, "Size=%" G_GINT64_FORMAT "\n", priv->size);
+    g_string_append_printf (str, "Completed=%" G_GINT64_FORMAT "\n", priv->completed);
 
-    fwrite ("\nDestination=", 1, 13, fptr);
-    fwrite (priv->dest, 1, strlen (priv->dest), fptr);
+    state_store_put (state_store_get_default (), priv->key, str->str, str->len);
 
-    str = g_strdup_printf ("\nState=%d\n", priv->state);
-    fwrite (str, 1, strlen (str), fptr);
-    g_free (str);
+    g_string_free (str, TRUE);
 
-    str = g_strdup_printf ("\nSize=%d\n", priv->size);
-    fwrite (str, 1, strlen (str), fptr);
-    g_free (str);
+    return TRUE;
+}
 
-    str = g_strdup_printf ("Completed=%d\n", priv->completed);
-    fwrite (str, 1, strlen (str), fptr);
-    g_free (str);
+static gboolean
+megaupload_download_forget (Download *self)
+{
+    state_store_remove (state_store_get_default (), MEGAUPLOAD_DOWNLOAD (self)->priv->key);
 
-    fclose (fptr);
+    return TRUE;
 }
 
 gchar*
@@ -232,13 +296,19 @@ megaupload_download_get_title (Download *self)
     }
 }
 
-gint
+const gchar*
+megaupload_download_get_source (Download *self)
+{
+    return MEGAUPLOAD_DOWNLOAD (self)->priv->source;
+}
+
+goffset
 megaupload_download_get_size_total (Download *self)
 {
     return MEGAUPLOAD_DOWNLOAD (self)->priv->size;
 }
 
-gint
+goffset
 megaupload_download_get_size_completed (Download *self)
 {
     return MEGAUPLOAD_DOWNLOAD (self)->priv->completed;
@@ -262,19 +332,74 @@ megaupload_download_get_state (Download *self)
     return MEGAUPLOAD_DOWNLOAD (self)->priv->state;
 }
 
+static void
+megaupload_download_begin_scan (MegauploadDownload *self, const gchar *mark)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
+
+    priv->scan = MEGAUPLOAD_SCAN_MARK;
+    priv->mark = mark;
+    g_string_truncate (priv->token, 0);
+}
+
+static void
+megaupload_download_request_page (MegauploadDownload *self)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
+
+    g_free (priv->cap.captchacode);
+    g_free (priv->cap.megavar);
+    g_free (priv->cap.img_addr);
+    priv->cap.captchacode = priv->cap.megavar = priv->cap.img_addr = NULL;
+
+    megaupload_download_begin_scan (self, MEGAUPLOAD_FORM_MARK);
+
+    curl_easy_setopt (priv->curl, CURLOPT_URL, priv->source);
+
+    priv->stage = MEGAUPLOAD_STAGE_DFIRST;
+
+    transfer_engine_add (transfer_engine_get_default (), priv->curl, G_OBJECT (self),
+        (TransferDoneFunc) megaupload_download_first_done, self);
+}
+
+static void
+megaupload_download_setup (MegauploadDownload *self)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
+
+    if (!priv->curl) {
+        priv->curl = transfer_engine_get_handle (transfer_engine_get_default ());
+    }
+
+    curl_easy_setopt (priv->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback) megaupload_download_write_data);
+    curl_easy_setopt (priv->curl, CURLOPT_WRITEDATA, self);
+
+    curl_easy_setopt (priv->curl, CURLOPT_NOPROGRESS, 0);
+    curl_easy_setopt (priv->curl, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback) megaupload_download_progress);
+    curl_easy_setopt (priv->curl, CURLOPT_PROGRESSDATA, self);
+}
+
 gboolean
 megaupload_download_start (Download *self)
 {
     MegauploadDownloadPrivate *priv = MEGAUPLOAD_DOWNLOAD (self)->priv;
 
-    priv->main = g_thread_create ((GThreadFunc) megaupload_download_main,
-        MEGAUPLOAD_DOWNLOAD (self), TRUE, NULL);
+    priv->state = DOWNLOAD_STATE_RUNNING;
+    _emit_download_state_changed (self, priv->state);
+
+    // File links do not last and need a captcha answered, each start
+    // scrapes its own once it has a slot
+    megaupload_download_setup (MEGAUPLOAD_DOWNLOAD (self));
+    megaupload_download_request_page (MEGAUPLOAD_DOWNLOAD (self));
+
+    return TRUE;
 }
 
 static gboolean
 megaupload_download_queue (Download *self)
 {
     MEGAUPLOAD_DOWNLOAD (self)->priv->state = DOWNLOAD_STATE_QUEUED;
+    _emit_download_state_changed (self, DOWNLOAD_STATE_QUEUED);
 }
 
 gboolean
@@ -296,55 +421,14 @@ megaupload_download_pause (Download *self)
 
     switch (priv->state) {
         case DOWNLOAD_STATE_RUNNING:
+            // The write callback aborts the transfer on its next chunk
             priv->state = DOWNLOAD_STATE_PAUSED;
-            g_thread_join (priv->main);
+            _emit_download_state_changed (self, priv->state);
             break;
     };
 }
 
-static void
-megaupload_download_parse_captcha (gchar *filename, MUCaptcha *cap)
-{
-    GMarkupParser get_captcha = {
-        .start_element = megaupload_download_start_element,
-    };
-
-    GMarkupParseContext *context;
-    GError *err;
-
-    FILE *fptr = fopen (filename, "r");
-    gchar *data = g_new0 (gchar, 1024);
-    gchar *datapos;
-    gint len;
-
-    context = g_markup_parse_context_new (&get_captcha, 0, cap, NULL);
-    gboolean found = FALSE;
-
-    while ((len = fread (data, 1, 1024, fptr)) > 0) {
-        if (!found) {
-            gchar *str = g_strrstr_len (data, len, "<FORM method=\"POST\" id=\"captchaform\">");
-            if (str) {
-                found = TRUE;
-                datapos = str;
-            }
-        } else {
-            datapos = data;
-        }
-
-        if (found) {
-            err = NULL;
-            gint dlen = data == datapos ? len : len - (datapos - data);
-            g_markup_parse_context_parse (context, datapos, dlen, &err);
-            if (err) {
-                g_error_free (err);
-                break;
-            }
-        }
-    }
-
-    fclose (fptr);
-}
-
+#ifndef GDMAN_HEADLESS
 static void
 megaupload_download_get_captcha (GtkWidget *img, MUCaptcha *cap)
 {
@@ -377,35 +461,77 @@ megaupload_download_get_captcha (GtkWidget *img, MUCaptcha *cap)
     gtk_widget_destroy (dialog);
     gdk_threads_leave ();
 }
+#endif
 
-static gchar*
-megaupload_download_parse_dl_link (gchar *filename)
+/*
+ * Feed the next chunk of a page to the scan for its marker and then the
+ * captcha form or the link after it. Returns TRUE once done with the page.
+ */
+static gboolean
+megaupload_download_scan_page (MegauploadDownload *self, const gchar *buff, gsize len)
 {
-    GMarkupParseContext *context;
-
-    FILE *fptr = fopen (filename, "r");
-    gchar *data = g_new0 (gchar, 5*1024);
-    gchar *url = NULL;
-    gint len, i;
+    MegauploadDownloadPrivate *priv = self->priv;
+    GError *err = NULL;
+    gchar *str;
 
-    while ((len = fread (data, 1, 5*1024, fptr)) > 0) {
-        gchar *str = g_strstr_len (data, len, "downloadlink");
-        if (str) {
-            for (i = 23; i < len - (str-data); i++) {
-                if (str[i] == '\"') {
-                    str[i] = '\0';
+    switch (priv->scan) {
+        case MEGAUPLOAD_SCAN_FORM:
+            g_string_append_len (priv->token, buff, len);
+            break;
+        case MEGAUPLOAD_SCAN_DONE:
+            return TRUE;
+        default:
+            g_string_append_len (priv->token, buff, len);
+            str = g_strstr_len (priv->token->str, priv->token->len, priv->mark);
+            if (!str) {
+                // Keep a tail that may be the start of the marker
+                gsize keep = strlen (priv->mark) - 1;
+                if (priv->token->len > keep) {
+                    g_string_erase (priv->token, 0, priv->token->len - keep);
                 }
+                return FALSE;
             }
 
-            url = g_strdup (str+23);
-            break;
-        }
+            if (priv->stage == MEGAUPLOAD_STAGE_DFIRST) {
+                GMarkupParser get_captcha = {
+                    .start_element = megaupload_download_start_element,
+                };
+
+                g_string_erase (priv->token, 0, str - priv->token->str);
+                priv->form = g_markup_parse_context_new (&get_captcha, 0, &priv->cap, NULL);
+                priv->scan = MEGAUPLOAD_SCAN_FORM;
+            } else {
+                g_string_erase (priv->token, 0, str - priv->token->str + strlen (priv->mark));
+                priv->scan = MEGAUPLOAD_SCAN_LINK;
+            }
     }
 
-    g_free (data);
-    fclose (fptr);
+    if (priv->scan == MEGAUPLOAD_SCAN_FORM) {
+        g_markup_parse_context_parse (priv->form, priv->token->str, priv->token->len, &err);
+        g_string_truncate (priv->token, 0);
 
-    return url;
+        // The page is no markup past the form
+        if (err) {
+            g_error_free (err);
+            priv->scan = MEGAUPLOAD_SCAN_DONE;
+        } else if (priv->cap.captchacode && priv->cap.megavar && priv->cap.img_addr) {
+            priv->scan = MEGAUPLOAD_SCAN_DONE;
+        }
+    } else if (priv->token->len > MEGAUPLOAD_LINK_OFFSET) {
+        str = memchr (priv->token->str + MEGAUPLOAD_LINK_OFFSET, '\"',
+            priv->token->len - MEGAUPLOAD_LINK_OFFSET);
+
+        if (str) {
+            g_string_truncate (priv->token, str - priv->token->str);
+            g_string_erase (priv->token, 0, MEGAUPLOAD_LINK_OFFSET);
+            priv->scan = MEGAUPLOAD_SCAN_DONE;
+        } else if (priv->token->len > MEGAUPLOAD_MAX_LINK) {
+            g_string_truncate (priv->token, 0);
+            priv->scan = MEGAUPLOAD_SCAN_DONE;
+        }
+    }
+
+    return priv->scan == MEGAUPLOAD_SCAN_DONE;
 }
 
 static void
@@ -452,8 +578,8 @@ megaupload_download_write_data (char *buff, size_t size, size_t num, MegauploadD
     }
 
     switch (self->priv->stage) {
+#ifndef GDMAN_HEADLESS
         case MEGAUPLOAD_STAGE_DSECOND:
-            fwrite (buff, size, num, self->priv->fptr);
             gdk_pixbuf_loader_write (self->priv->img_loader, buff, size * num, &err);
             if (err) {
                 g_print ("Error Loading img: %s\n", err->message);
@@ -462,176 +588,281 @@ megaupload_download_write_data (char *buff, size_t size, size_t num, MegauploadD
                 return -1;
             }
             break;
+#endif
         case MEGAUPLOAD_STAGE_DFILE:
             if (self->priv->size == 0) {
-                gdouble cl;
-                curl_easy_getinfo (self->priv->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &cl);
+                curl_off_t cl;
+                curl_easy_getinfo (self->priv->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl);
                 self->priv->size = cl;
             }
-            fwrite (buff, size, num, self->priv->fptr);
+            if (!rate_limiter_consume (rate_limiter_get_default (), DOWNLOAD (self),
+                    self->priv->curl, size * num)) {
+                return CURL_WRITEFUNC_PAUSE;
+            }
+
+            switch (disk_stream_write (self->priv->out, buff, size * num)) {
+                case DISK_STREAM_FULL:
+                    // The chunk comes again once the writer caught up
+                    rate_limiter_refund (rate_limiter_get_default (), DOWNLOAD (self), size * num);
+                    return CURL_WRITEFUNC_PAUSE;
+                case DISK_STREAM_ERROR:
+                    return -1;
+            }
+
             self->priv->completed += size * num;
+            break;
         default:
-            fwrite (buff, size, num, self->priv->fptr);
+            if (megaupload_download_scan_page (self, buff, size * num)) {
+                // The rest of the page is of no use
+                return 0;
+            }
     }
 
     return size * num;
 }
 
-gpointer
-megaupload_download_main (MegauploadDownload *self)
+static const gchar*
+megaupload_download_get_id (MegauploadDownload *self)
 {
-    gint i = 0;
-
-    self->priv->curl = curl_easy_init ();
-
-    while (self->priv->source[i++]);
-    while (self->priv->source[--i] != '=');
-
-    gchar *filename = g_strdup_printf ("/tmp/mu%s.html", self->priv->source+i+1);
-    self->priv->fptr = fopen (filename, "w");
+    gint i = strlen (self->priv->source);
+    while (i > 0 && self->priv->source[--i] != '=');
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, self->priv->source);
-
-    curl_easy_setopt (self->priv->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback) megaupload_download_write_data);
-    curl_easy_setopt (self->priv->curl, CURLOPT_WRITEDATA, self);
+    return self->priv->source+i+1;
+}
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOPROGRESS, 0);
-    curl_easy_setopt (self->priv->curl, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback) megaupload_download_progress);
-    curl_easy_setopt (self->priv->curl, CURLOPT_PROGRESSDATA, self);
+// Whether a page request should be followed up
+static gboolean
+megaupload_download_page_ok (MegauploadDownload *self, CURLcode res)
+{
+    return res != CURLE_ABORTED_BY_CALLBACK && self->priv->state == DOWNLOAD_STATE_RUNNING;
+}
 
-    self->priv->state = DOWNLOAD_STATE_RUNNING;
-    self->priv->stage = MEGAUPLOAD_STAGE_DFIRST;
-    _emit_download_state_changed (DOWNLOAD (self), self->priv->state);
+static void
+megaupload_download_first_done (CURL *curl, CURLcode res, MegauploadDownload *self)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
 
-    curl_easy_perform (self->priv->curl);
-    fclose (self->priv->fptr);
+    if (priv->form) {
+        g_markup_parse_context_free (priv->form);
+        priv->form = NULL;
+    }
 
-    megaupload_download_parse_captcha (filename, &self->priv->cap);
-    g_free (filename);
+    if (!megaupload_download_page_ok (self, res)) {
+        return;
+    }
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, self->priv->cap.img_addr);
+#ifdef GDMAN_HEADLESS
+    // Nobody can answer the captcha without a display
+    g_print ("Captcha required for %s, not supported without the GUI\n", priv->source);
+    priv->state = DOWNLOAD_STATE_STOPPED;
+    _emit_download_state_changed (DOWNLOAD (self), priv->state);
+#else
+    curl_easy_setopt (priv->curl, CURLOPT_URL, priv->cap.img_addr);
 
-    self->priv->stage = MEGAUPLOAD_STAGE_DSECOND;
-    self->priv->img_loader = gdk_pixbuf_loader_new_with_type ("gif", NULL);
-    filename = g_strdup_printf ("/tmp/mu%s.gif", self->priv->source+i+1);
-    self->priv->fptr = fopen (filename, "w");
-    g_free (filename);
+    priv->stage = MEGAUPLOAD_STAGE_DSECOND;
+    priv->img_loader = gdk_pixbuf_loader_new_with_type ("gif", NULL);
 
-    curl_easy_perform (self->priv->curl);
+    transfer_engine_add (transfer_engine_get_default (), priv->curl, G_OBJECT (self),
+        (TransferDoneFunc) megaupload_download_second_done, self);
+#endif
+}
 
-    fclose (self->priv->fptr);
+#ifndef GDMAN_HEADLESS
+static void
+megaupload_download_second_done (CURL *curl, CURLcode res, MegauploadDownload *self)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
 
     GError *err = NULL;
-    gdk_pixbuf_loader_close (self->priv->img_loader, &err);
+    gdk_pixbuf_loader_close (priv->img_loader, &err);
     if (err) {
         g_print ("Error processing img: %s\n", err->message);
         g_error_free (err);
         err = NULL;
     }
 
-    GdkPixbuf *img = gdk_pixbuf_loader_get_pixbuf (self->priv->img_loader);
+    if (!megaupload_download_page_ok (self, res)) {
+        return;
+    }
+
+    // The captcha dialog has to run on the main loop, not the engine thread
+    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, (GSourceFunc) megaupload_download_ask_captcha,
+        g_object_ref (self), g_object_unref);
+}
+
+static gboolean
+megaupload_download_ask_captcha (MegauploadDownload *self)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
+
+    GdkPixbuf *img = gdk_pixbuf_loader_get_pixbuf (priv->img_loader);
     GtkWidget *img_w = gtk_image_new_from_pixbuf (img);
 
-    megaupload_download_get_captcha (img_w, &self->priv->cap);
+    megaupload_download_get_captcha (img_w, &priv->cap);
+
+    g_object_unref (priv->img_loader);
+    priv->img_loader = NULL;
+
+    megaupload_download_begin_scan (self, MEGAUPLOAD_LINK_MARK);
+
+    curl_easy_setopt (priv->curl, CURLOPT_URL, priv->source);
+
+    g_free (priv->post);
+    priv->post = g_strdup_printf ("captcha=%s&captchacode=%s&megavar=%s",
+        priv->cap.captcha, priv->cap.captchacode, priv->cap.megavar);
+    curl_easy_setopt (priv->curl, CURLOPT_POST, 1);
+    curl_easy_setopt (priv->curl, CURLOPT_POSTFIELDS, priv->post);
+    curl_easy_setopt (priv->curl, CURLOPT_REFERER, priv->source);
 
-    g_object_unref (img_w);
+    priv->stage = MEGAUPLOAD_STAGE_DTHIRD;
+    _emit_download_state_changed (DOWNLOAD (self), priv->state);
 
-    filename = g_strdup_printf ("/tmp/mu%s-2.html", self->priv->source+i+1);
-    self->priv->fptr = fopen (filename, "w");
+    transfer_engine_add (transfer_engine_get_default (), priv->curl, G_OBJECT (self),
+        (TransferDoneFunc) megaupload_download_third_done, self);
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_VERBOSE, 1);
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, self->priv->source);
+    return FALSE;
+}
+#endif
+
+static void
+megaupload_download_third_done (CURL *curl, CURLcode res, MegauploadDownload *self)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
+
+    g_free (priv->post);
+    priv->post = NULL;
 
-    gchar *str = g_strdup_printf ("captcha=%s&captchacode=%s&megavar=%s",
-        self->priv->cap.captcha, self->priv->cap.captchacode, self->priv->cap.megavar);
-    curl_easy_setopt (self->priv->curl, CURLOPT_POST, 1);
-    curl_easy_setopt (self->priv->curl, CURLOPT_POSTFIELDS, str);
-    curl_easy_setopt (self->priv->curl, CURLOPT_REFERER, self->priv->source);
+    if (!megaupload_download_page_ok (self, res)) {
+        return;
+    }
 
-    self->priv->stage = MEGAUPLOAD_STAGE_DTHIRD;
-    _emit_download_state_changed (DOWNLOAD (self), self->priv->state);
+    gchar *name = NULL;
+    if (priv->scan == MEGAUPLOAD_SCAN_DONE && priv->token->len > 0) {
+        name = g_strdup (priv->token->str);
+    }
+
+    if (!name) {
+        priv->state = DOWNLOAD_STATE_STOPPED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return;
+    }
 
-    curl_easy_perform (self->priv->curl);
-    g_free (str);
-    fclose (self->priv->fptr);
+    megaupload_download_fetch_file (self, name);
+    g_free (name);
+}
 
-    gchar *name = megaupload_download_parse_dl_link (filename);
-    g_free (filename);
+static void
+megaupload_download_fetch_file (MegauploadDownload *self, const gchar *name)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
 
     gchar *newdest = NULL;
-    if (self->priv->dest[0] == '/') {
-        newdest = g_strdup (self->priv->dest);
-    } else if (self->priv->dest[0] == '~') {
-        newdest = g_build_filename (g_get_home_dir (), self->priv->dest+2, NULL);
+    if (priv->dest[0] == '/') {
+        newdest = g_strdup (priv->dest);
+    } else if (priv->dest[0] == '~') {
+        newdest = g_build_filename (g_get_home_dir (), priv->dest+2, NULL);
     } else {
-        newdest = g_build_filename (g_get_tmp_dir (), self->priv->dest, NULL);
+        newdest = g_build_filename (g_get_tmp_dir (), priv->dest, NULL);
     }
 
     if (g_file_test (newdest, G_FILE_TEST_IS_DIR)) {
         gint len = strlen (name);
         while (name[--len] != '/');
-        newdest = g_build_filename (newdest, name + len, NULL);
+        gchar *filedest = g_build_filename (newdest, name + len, NULL);
+        g_free (newdest);
+        newdest = filedest;
     }
 
-    g_free (self->priv->dest);
-    self->priv->dest = newdest;
+    g_free (priv->dest);
+    priv->dest = newdest;
 
-    g_print ("URL: %s\n", name);
-    g_print ("DEST: %s\n", self->priv->dest);
-
-/*
-    // Get file length in a HEAD request
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, name);
-    curl_easy_setopt (self->priv->curl, CURLOPT_HTTPGET, 1);
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOBODY, 1);
-    curl_easy_setopt (self->priv->curl, CURLOPT_REFERER, self->priv->source);
-
-    curl_easy_perform (self->priv->curl);
-    g_print ("Post Perform\n");
-
-    gdouble cl;
-    curl_easy_getinfo (self->priv->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &cl);
-*/
     struct stat ostat;
-    g_stat (self->priv->dest, &ostat);
+    if (g_stat (priv->dest, &ostat) != 0) {
+        ostat.st_size = 0;
+    }
 
-//    g_print ("CL: %f\n", cl);
-    g_print ("STAT: %d\n", ostat.st_size);
+    curl_easy_setopt (priv->curl, CURLOPT_URL, name);
+    curl_easy_setopt (priv->curl, CURLOPT_HTTPGET, 1);
+    curl_easy_setopt (priv->curl, CURLOPT_NOBODY, 0);
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, name);
-    curl_easy_setopt (self->priv->curl, CURLOPT_HTTPGET, 1);
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOBODY, 0);
+    gint fd;
 
-//    self->priv->size = cl;
-    if (ostat.st_size > 0 && ostat.st_size == self->priv->completed && ostat.st_size < self->priv->size) {
+    if (ostat.st_size > 0 && ostat.st_size == priv->completed && ostat.st_size < priv->size) {
         // If file has a length > 0 and is the same as the stored completed value
         // and the file is not already downloaded, continue where left off
-        self->priv->completed = ostat.st_size;
-        curl_easy_setopt (self->priv->curl, CURLOPT_RESUME_FROM, (long) self->priv->completed);
+        priv->completed = ostat.st_size;
+        curl_easy_setopt (priv->curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) priv->completed);
 
-        self->priv->fptr = fopen (self->priv->dest, "a");
-    } else if (ostat.st_size == self->priv->size && self->priv->size != 0) {
+        fd = g_open (priv->dest, O_WRONLY, 0644);
+    } else if (ostat.st_size == priv->size && priv->size != 0) {
         // Download is completed
-        self->priv->state = DOWNLOAD_STATE_COMPLETED;
+        priv->state = DOWNLOAD_STATE_COMPLETED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
         return;
     } else {
         // Either the download is new or an error occured so start over
-        self->priv->fptr = fopen (self->priv->dest, "w");
+        priv->completed = 0;
+        fd = g_open (priv->dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    if (fd == -1) {
+        g_print ("Error opening %s\n", priv->dest);
+        priv->state = DOWNLOAD_STATE_STOPPED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return;
     }
 
-    self->priv->fptr = fopen (self->priv->dest, "w");
+    priv->file = disk_file_new (fd);
+    priv->out = disk_stream_new (priv->file, priv->completed, priv->curl);
 
-    self->priv->stage = MEGAUPLOAD_STAGE_DFILE;
-    _emit_download_state_changed (DOWNLOAD (self), self->priv->state);
+    priv->stage = MEGAUPLOAD_STAGE_DFILE;
+    _emit_download_state_changed (DOWNLOAD (self), priv->state);
 
-    g_print ("Starting Download\n");
-    curl_easy_perform (self->priv->curl);
-    g_print ("Stopped Download\n");
-    g_free (name);
+    transfer_engine_add (transfer_engine_get_default (), priv->curl, G_OBJECT (self),
+        (TransferDoneFunc) megaupload_download_file_done, self);
+}
+
+static void
+megaupload_download_file_done (CURL *curl, CURLcode res, MegauploadDownload *self)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
+
+    disk_stream_close (priv->out);
+    priv->out = NULL;
+
+    transfer_engine_release_handle (transfer_engine_get_default (), priv->curl);
+    priv->curl = NULL;
+
+    // The state is only settled once the writer has the data on disk
+    priv->result = res;
+    disk_file_finish (priv->file, res == CURLE_OK,
+        (DiskFileDoneFunc) megaupload_download_written, g_object_ref (self));
+
+    disk_file_unref (priv->file);
+    priv->file = NULL;
+}
+
+/*
+ * Called from the writer thread once everything received is written and
+ * synced, or failed to be.
+ */
+static void
+megaupload_download_written (gboolean ok, MegauploadDownload *self)
+{
+    MegauploadDownloadPrivate *priv = self->priv;
 
-    fclose (self->priv->fptr);
+    if (priv->state == DOWNLOAD_STATE_RUNNING && priv->result != CURLE_ABORTED_BY_CALLBACK) {
+        if (!ok) {
+            priv->state = DOWNLOAD_STATE_ERROR;
+        } else if (priv->result != CURLE_OK) {
+            priv->state = DOWNLOAD_STATE_STOPPED;
+        } else {
+            priv->state = DOWNLOAD_STATE_COMPLETED;
+        }
+
+        priv->stage = MEGAUPLOAD_STATE_NONE;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+    }
 
-    self->priv->state = DOWNLOAD_STATE_COMPLETED;
-    self->priv->stage = MEGAUPLOAD_STATE_NONE;
-    _emit_download_state_changed (DOWNLOAD (self), self->priv->state);
+    g_object_unref (self);
 }
@@ -25,6 +25,7 @@
 #include <glib-object.h>
 
 #include "download.h"
+#include "download-registry.h"
 
 #define MEGAUPLOAD_DOWNLOAD_TYPE (megaupload_download_get_type ())
 #define MEGAUPLOAD_DOWNLOAD(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), MEGAUPLOAD_DOWNLOAD_TYPE, MegauploadDownload))
@@ -33,6 +34,9 @@
 #define IS_MEGAUPLOAD_DOWNLOAD_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), MEGAUPLOAD_DOWNLOAD_TYPE))
 #define MEGAUPLOAD_DOWNLOAD_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), MEGAUPLOAD_DOWNLOAD_TYPE, MegauploadDownloadClass))
 
+// Saved state is keyed <id>.megaupload
+#define MEGAUPLOAD_DOWNLOAD_TAG "megaupload"
+
 G_BEGIN_DECLS
 
 typedef struct _MegauploadDownload MegauploadDownload;
@@ -52,7 +56,8 @@ struct _MegauploadDownloadClass {
 Download *megaupload_download_new (const gchar *source, const gchar *dest);
 GType megaupload_download_get_type (void);
 
-Download *megaupload_download_new_from_file (const gchar *filename);
+Download *megaupload_download_new_from_data (const gchar *key, const gchar *data, gsize len);
+void megaupload_download_register (DownloadRegistry *registry);
 
 G_END_DECLS
 
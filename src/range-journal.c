@@ -0,0 +1,407 @@
+/*
+ *      range-journal.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
+
+#include "range-journal.h"
+
+#define RANGE_JOURNAL_MAGIC "GDMJ"
+#define RANGE_JOURNAL_VERSION 1
+
+typedef struct _JournalHeader JournalHeader;
+struct _JournalHeader {
+    gchar magic[4];
+    guint32 version;
+    gint64 size;
+};
+
+// Half open range [start, end) of the destination file
+typedef struct _JournalRange JournalRange;
+struct _JournalRange {
+    gint64 start;
+    gint64 end;
+};
+
+struct _RangeJournal {
+    gchar *path;
+    gint fd;
+    goffset size;
+
+    // Sorted and merged ranges known to be durable or about to be
+    GArray *ranges;
+
+    // Records not yet appended to the journal file
+    GArray *pending;
+    guint records;
+
+    // Set once a newer journal of the same path took over, the file is
+    // no longer touched. Guarded by lock, which is held while writing.
+    GMutex *lock;
+    gboolean detached;
+};
+
+// Open journals by path, so a restarted download cannot append to the
+// file of the one still being flushed
+G_LOCK_DEFINE_STATIC (journals);
+static GHashTable *journals = NULL;
+
+static gboolean
+range_journal_write_all (gint fd, gconstpointer data, gsize len)
+{
+    const gchar *buff = data;
+
+    while (len > 0) {
+        gssize n = write (fd, buff, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return FALSE;
+        }
+
+        buff += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+static void
+range_journal_insert (GArray *ranges, goffset start, goffset end)
+{
+    JournalRange r = { start, end };
+    gint i = 0;
+
+    // Skip ranges ending before this one, then swallow any it touches
+    while (i < ranges->len && g_array_index (ranges, JournalRange, i).end < start) {
+        i++;
+    }
+
+    while (i < ranges->len && g_array_index (ranges, JournalRange, i).start <= r.end) {
+        JournalRange *o = &g_array_index (ranges, JournalRange, i);
+
+        r.start = MIN (r.start, o->start);
+        r.end = MAX (r.end, o->end);
+        g_array_remove_index (ranges, i);
+    }
+
+    g_array_insert_val (ranges, i, r);
+}
+
+static gboolean
+range_journal_load (RangeJournal *self)
+{
+    JournalHeader *header;
+    gchar *data;
+    gsize len, i;
+
+    if (!g_file_get_contents (self->path, &data, &len, NULL)) {
+        return FALSE;
+    }
+
+    header = (JournalHeader*) data;
+    if (len < sizeof (JournalHeader) ||
+        memcmp (header->magic, RANGE_JOURNAL_MAGIC, 4) != 0 ||
+        header->version != RANGE_JOURNAL_VERSION || header->size != self->size) {
+        g_free (data);
+        return FALSE;
+    }
+
+    // A torn record at the end of the file is left out and overwritten
+    len = sizeof (JournalHeader) +
+        (len - sizeof (JournalHeader)) / sizeof (JournalRange) * sizeof (JournalRange);
+
+    for (i = sizeof (JournalHeader); i < len; i += sizeof (JournalRange)) {
+        JournalRange *r = (JournalRange*) (data + i);
+
+        if (r->start >= 0 && r->start < r->end && r->end <= self->size) {
+            range_journal_insert (self->ranges, r->start, r->end);
+        }
+
+        self->records++;
+    }
+
+    g_free (data);
+
+    self->fd = g_open (self->path, O_WRONLY, 0644);
+    if (self->fd == -1 || ftruncate (self->fd, len) != 0 ||
+        lseek (self->fd, len, SEEK_SET) == -1) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Write the header and the merged ranges to path and make it the file
+// records are appended to
+static gboolean
+range_journal_create (RangeJournal *self, const gchar *path)
+{
+    JournalHeader header;
+    gint fd;
+
+    memcpy (header.magic, RANGE_JOURNAL_MAGIC, 4);
+    header.version = RANGE_JOURNAL_VERSION;
+    header.size = self->size;
+
+    fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return FALSE;
+    }
+
+    if (!range_journal_write_all (fd, &header, sizeof (header)) ||
+        !range_journal_write_all (fd, self->ranges->data,
+            self->ranges->len * sizeof (JournalRange)) ||
+        fdatasync (fd) != 0) {
+        close (fd);
+        return FALSE;
+    }
+
+    if (self->fd != -1) {
+        close (self->fd);
+    }
+
+    self->fd = fd;
+    self->records = self->ranges->len;
+
+    return TRUE;
+}
+
+static void
+range_journal_detach (RangeJournal *self)
+{
+    g_mutex_lock (self->lock);
+
+    if (self->fd != -1) {
+        close (self->fd);
+        self->fd = -1;
+    }
+    self->detached = TRUE;
+
+    g_mutex_unlock (self->lock);
+}
+
+RangeJournal*
+range_journal_open (const gchar *dest, goffset size)
+{
+    RangeJournal *self = g_new0 (RangeJournal, 1), *old;
+
+    self->path = g_strconcat (dest, ".journal", NULL);
+    self->fd = -1;
+    self->size = size;
+    self->ranges = g_array_new (FALSE, FALSE, sizeof (JournalRange));
+    self->pending = g_array_new (FALSE, FALSE, sizeof (JournalRange));
+    self->lock = g_mutex_new ();
+
+    G_LOCK (journals);
+    if (!journals) {
+        journals = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+
+    old = g_hash_table_lookup (journals, self->path);
+    if (old) {
+        range_journal_detach (old);
+    }
+
+    g_hash_table_insert (journals, self->path, self);
+    G_UNLOCK (journals);
+
+    if (!range_journal_load (self)) {
+        // Missing, damaged or describing another file. The file is only
+        // written by the first commit, off the thread opening it.
+        if (self->fd != -1) {
+            close (self->fd);
+            self->fd = -1;
+        }
+
+        g_array_set_size (self->ranges, 0);
+        self->records = 0;
+    }
+
+    return self;
+}
+
+void
+range_journal_reset (RangeJournal *self)
+{
+    G_LOCK (journals);
+    g_mutex_lock (self->lock);
+
+    g_array_set_size (self->ranges, 0);
+    g_array_set_size (self->pending, 0);
+    self->records = 0;
+
+    if (self->fd != -1) {
+        close (self->fd);
+        self->fd = -1;
+    }
+
+    if (!self->detached) {
+        g_unlink (self->path);
+    }
+
+    g_mutex_unlock (self->lock);
+    G_UNLOCK (journals);
+}
+
+void
+range_journal_free (RangeJournal *self)
+{
+    G_LOCK (journals);
+    if (g_hash_table_lookup (journals, self->path) == self) {
+        g_hash_table_remove (journals, self->path);
+    }
+    G_UNLOCK (journals);
+
+    if (self->fd != -1) {
+        close (self->fd);
+    }
+
+    g_mutex_free (self->lock);
+    g_array_free (self->ranges, TRUE);
+    g_array_free (self->pending, TRUE);
+    g_free (self->path);
+    g_free (self);
+}
+
+void
+range_journal_discard (RangeJournal *self)
+{
+    // A detached journal no longer owns the file
+    G_LOCK (journals);
+    if (!self->detached) {
+        g_unlink (self->path);
+    }
+    G_UNLOCK (journals);
+
+    range_journal_free (self);
+}
+
+gboolean
+range_journal_is_empty (RangeJournal *self)
+{
+    return self->ranges->len == 0;
+}
+
+gboolean
+range_journal_fits (RangeJournal *self, const gchar *dest)
+{
+    struct stat st;
+
+    if (self->ranges->len == 0) {
+        return TRUE;
+    }
+
+    JournalRange *last = &g_array_index (self->ranges, JournalRange, self->ranges->len - 1);
+
+    return g_stat (dest, &st) == 0 && st.st_size >= last->end;
+}
+
+goffset
+range_journal_contiguous (RangeJournal *self, goffset from)
+{
+    gint i;
+
+    for (i = 0; i < self->ranges->len; i++) {
+        JournalRange *r = &g_array_index (self->ranges, JournalRange, i);
+
+        if (r->start <= from && from < r->end) {
+            return r->end;
+        }
+    }
+
+    return from;
+}
+
+void
+range_journal_add (RangeJournal *self, goffset start, goffset end)
+{
+    if (self->pending->len > 0) {
+        JournalRange *last = &g_array_index (self->pending, JournalRange,
+            self->pending->len - 1);
+
+        // Sequential writes of a stream collapse into a single record
+        if (last->end == start) {
+            last->end = end;
+            range_journal_insert (self->ranges, start, end);
+            return;
+        }
+    }
+
+    JournalRange r = { start, end };
+    g_array_append_val (self->pending, r);
+    range_journal_insert (self->ranges, start, end);
+}
+
+gboolean
+range_journal_commit (RangeJournal *self)
+{
+    g_mutex_lock (self->lock);
+
+    if (self->detached || self->pending->len == 0) {
+        gboolean ok = !self->detached;
+
+        g_array_set_size (self->pending, 0);
+        g_mutex_unlock (self->lock);
+        return ok;
+    }
+
+    if (self->fd == -1) {
+        // First records of a new journal, the pending ones are in ranges
+        if (!range_journal_create (self, self->path)) {
+            g_print ("Error creating journal %s: %s\n", self->path, g_strerror (errno));
+            g_mutex_unlock (self->lock);
+            return FALSE;
+        }
+    } else if (!range_journal_write_all (self->fd, self->pending->data,
+            self->pending->len * sizeof (JournalRange)) ||
+        fdatasync (self->fd) != 0) {
+        g_print ("Error writing journal %s: %s\n", self->path, g_strerror (errno));
+        g_mutex_unlock (self->lock);
+        return FALSE;
+    } else {
+        self->records += self->pending->len;
+    }
+
+    g_array_set_size (self->pending, 0);
+
+    if (self->records > RANGE_JOURNAL_COMPACT_RECORDS &&
+        self->records > 4 * self->ranges->len) {
+        // Rewrite the merged ranges aside and swap them in atomically
+        gchar *tmp = g_strconcat (self->path, ".tmp", NULL);
+
+        if (range_journal_create (self, tmp)) {
+            g_rename (tmp, self->path);
+        }
+
+        g_free (tmp);
+    }
+
+    g_mutex_unlock (self->lock);
+
+    return TRUE;
+}
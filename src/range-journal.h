@@ -0,0 +1,60 @@
+/*
+ *      range-journal.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#ifndef __RANGE_JOURNAL_H__
+#define __RANGE_JOURNAL_H__
+
+#include <glib.h>
+
+// Journal is rewritten once it holds this many records and at least four
+// times more than the merged ranges
+#define RANGE_JOURNAL_COMPACT_RECORDS 1024
+
+G_BEGIN_DECLS
+
+/*
+ * A RangeJournal records which byte ranges of a destination file are known
+ * to be on disk. It lives next to the file as <dest>.journal and is made of
+ * fixed size records appended after the data they describe was synced.
+ *
+ * Opening a journal does no writes, the file is created by the first
+ * commit. Opening the path again detaches the older journal, whose
+ * commits are dropped from then on.
+ */
+typedef struct _RangeJournal RangeJournal;
+
+RangeJournal *range_journal_open (const gchar *dest, goffset size);
+void range_journal_reset (RangeJournal *self);
+void range_journal_free (RangeJournal *self);
+void range_journal_discard (RangeJournal *self);
+
+gboolean range_journal_is_empty (RangeJournal *self);
+
+// Whether dest is still there and long enough for every journaled range
+gboolean range_journal_fits (RangeJournal *self, const gchar *dest);
+goffset range_journal_contiguous (RangeJournal *self, goffset from);
+
+void range_journal_add (RangeJournal *self, goffset start, goffset end);
+gboolean range_journal_commit (RangeJournal *self);
+
+G_END_DECLS
+
+#endif /* __RANGE_JOURNAL_H__ */
@@ -0,0 +1,323 @@
+/*
+ *      rate-limiter.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rate-limiter.h"
+
+G_DEFINE_TYPE (RateLimiter, rate_limiter, G_TYPE_OBJECT)
+
+struct _RateBucket {
+    RateBucket *parent;
+
+    guint64 rate;
+
+    // May go below zero, a chunk already taken is never split
+    gint64 tokens;
+};
+
+struct _RateLimiterPrivate {
+    GMutex *lock;
+
+    RateBucket *global;
+    GSList *buckets;
+
+    // Download* -> RateBucket of that download
+    GHashTable *downloads;
+
+    // Paused handles in the order they hit a limit, resumed in turn
+    GQueue *waiting;
+    GHashTable *paused;
+
+    gint64 last;
+};
+
+static RateLimiter *instance = NULL;
+
+static void
+rate_limiter_finalize (GObject *object)
+{
+    RateLimiter *self = RATE_LIMITER (object);
+
+    g_slist_foreach (self->priv->buckets, (GFunc) g_free, NULL);
+    g_slist_free (self->priv->buckets);
+
+    g_hash_table_destroy (self->priv->downloads);
+    g_hash_table_destroy (self->priv->paused);
+    g_queue_free (self->priv->waiting);
+    g_mutex_free (self->priv->lock);
+
+    G_OBJECT_CLASS (rate_limiter_parent_class)->finalize (object);
+}
+
+static void
+rate_limiter_class_init (RateLimiterClass *klass)
+{
+    GObjectClass *object_class;
+    object_class = G_OBJECT_CLASS (klass);
+
+    g_type_class_add_private ((gpointer) klass, sizeof (RateLimiterPrivate));
+
+    object_class->finalize = rate_limiter_finalize;
+}
+
+static void
+rate_limiter_init (RateLimiter *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), RATE_LIMITER_TYPE, RateLimiterPrivate);
+
+    self->priv->lock = g_mutex_new ();
+    self->priv->buckets = NULL;
+    self->priv->downloads = g_hash_table_new (g_direct_hash, g_direct_equal);
+    self->priv->waiting = g_queue_new ();
+    self->priv->paused = g_hash_table_new (g_direct_hash, g_direct_equal);
+    self->priv->last = g_get_monotonic_time ();
+
+    self->priv->global = rate_limiter_bucket_new (self, NULL);
+}
+
+RateLimiter*
+rate_limiter_get_default (void)
+{
+    static gsize once = 0;
+
+    // Used from the transfer threads as well as the main loop
+    if (g_once_init_enter (&once)) {
+        instance = g_object_new (RATE_LIMITER_TYPE, NULL);
+        g_once_init_leave (&once, 1);
+    }
+
+    return instance;
+}
+
+RateBucket*
+rate_limiter_get_global (RateLimiter *self)
+{
+    return self->priv->global;
+}
+
+RateBucket*
+rate_limiter_bucket_new (RateLimiter *self, RateBucket *parent)
+{
+    RateBucket *bucket = g_new0 (RateBucket, 1);
+
+    bucket->parent = parent;
+
+    g_mutex_lock (self->priv->lock);
+    self->priv->buckets = g_slist_prepend (self->priv->buckets, bucket);
+    g_mutex_unlock (self->priv->lock);
+
+    return bucket;
+}
+
+void
+rate_limiter_bucket_free (RateLimiter *self, RateBucket *bucket)
+{
+    g_mutex_lock (self->priv->lock);
+    self->priv->buckets = g_slist_remove (self->priv->buckets, bucket);
+    g_mutex_unlock (self->priv->lock);
+
+    g_free (bucket);
+}
+
+void
+rate_limiter_set_rate (RateLimiter *self, RateBucket *bucket, guint64 rate)
+{
+    g_mutex_lock (self->priv->lock);
+
+    bucket->rate = rate;
+    bucket->tokens = MIN (bucket->tokens, (gint64) (rate * RATE_LIMITER_BURST / 1000));
+
+    g_mutex_unlock (self->priv->lock);
+}
+
+void
+rate_limiter_attach (RateLimiter *self, Download *d, RateBucket *parent)
+{
+    RateBucket *bucket = rate_limiter_bucket_new (self, parent);
+
+    g_mutex_lock (self->priv->lock);
+    g_hash_table_insert (self->priv->downloads, d, bucket);
+    g_mutex_unlock (self->priv->lock);
+}
+
+void
+rate_limiter_detach (RateLimiter *self, Download *d)
+{
+    g_mutex_lock (self->priv->lock);
+
+    RateBucket *bucket = g_hash_table_lookup (self->priv->downloads, d);
+    g_hash_table_remove (self->priv->downloads, d);
+
+    g_mutex_unlock (self->priv->lock);
+
+    if (bucket) {
+        rate_limiter_bucket_free (self, bucket);
+    }
+}
+
+void
+rate_limiter_set_download_rate (RateLimiter *self, Download *d, guint64 rate)
+{
+    g_mutex_lock (self->priv->lock);
+    RateBucket *bucket = g_hash_table_lookup (self->priv->downloads, d);
+    g_mutex_unlock (self->priv->lock);
+
+    if (bucket) {
+        rate_limiter_set_rate (self, bucket, rate);
+    }
+}
+
+static gboolean
+rate_bucket_available (RateBucket *bucket)
+{
+    for (; bucket; bucket = bucket->parent) {
+        if (bucket->rate > 0 && bucket->tokens <= 0) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+gboolean
+rate_limiter_consume (RateLimiter *self, Download *d, CURL *curl, gsize len)
+{
+    RateLimiterPrivate *priv = self->priv;
+    RateBucket *bucket;
+    gboolean ok;
+
+    g_mutex_lock (priv->lock);
+
+    bucket = g_hash_table_lookup (priv->downloads, d);
+    if (!bucket) {
+        bucket = priv->global;
+    }
+
+    ok = rate_bucket_available (bucket);
+
+    if (ok) {
+        for (; bucket; bucket = bucket->parent) {
+            if (bucket->rate > 0) {
+                bucket->tokens -= len;
+            }
+        }
+    } else if (!g_hash_table_lookup (priv->paused, curl)) {
+        // Handles resumed and paused again go to the back of the line so
+        // every download gets its turn at the budget
+        g_hash_table_insert (priv->paused, curl, d);
+        g_queue_push_tail (priv->waiting, curl);
+    }
+
+    g_mutex_unlock (priv->lock);
+
+    return ok;
+}
+
+void
+rate_limiter_refund (RateLimiter *self, Download *d, gsize len)
+{
+    RateLimiterPrivate *priv = self->priv;
+    RateBucket *bucket;
+
+    g_mutex_lock (priv->lock);
+
+    bucket = g_hash_table_lookup (priv->downloads, d);
+    if (!bucket) {
+        bucket = priv->global;
+    }
+
+    for (; bucket; bucket = bucket->parent) {
+        if (bucket->rate > 0) {
+            bucket->tokens += len;
+        }
+    }
+
+    g_mutex_unlock (priv->lock);
+}
+
+GSList*
+rate_limiter_tick (RateLimiter *self)
+{
+    RateLimiterPrivate *priv = self->priv;
+    GSList *resume = NULL, *iter;
+    gint64 now = g_get_monotonic_time ();
+    gint n;
+
+    g_mutex_lock (priv->lock);
+
+    gint64 elapsed = now - priv->last;
+    priv->last = now;
+
+    for (iter = priv->buckets; iter; iter = iter->next) {
+        RateBucket *bucket = iter->data;
+
+        if (bucket->rate > 0) {
+            gint64 burst = bucket->rate * RATE_LIMITER_BURST / 1000;
+
+            bucket->tokens += bucket->rate * elapsed / G_USEC_PER_SEC;
+            bucket->tokens = MIN (bucket->tokens, burst);
+        }
+    }
+
+    // Handles that can go on leave the queue, the rest keep their place
+    for (n = g_queue_get_length (priv->waiting); n > 0; n--) {
+        CURL *curl = g_queue_pop_head (priv->waiting);
+        Download *d = g_hash_table_lookup (priv->paused, curl);
+        RateBucket *bucket = g_hash_table_lookup (priv->downloads, d);
+
+        if (rate_bucket_available (bucket ? bucket : priv->global)) {
+            g_hash_table_remove (priv->paused, curl);
+            resume = g_slist_prepend (resume, curl);
+        } else {
+            g_queue_push_tail (priv->waiting, curl);
+        }
+    }
+
+    g_mutex_unlock (priv->lock);
+
+    return g_slist_reverse (resume);
+}
+
+gboolean
+rate_limiter_is_waiting (RateLimiter *self)
+{
+    gboolean waiting;
+
+    g_mutex_lock (self->priv->lock);
+    waiting = !g_queue_is_empty (self->priv->waiting);
+    g_mutex_unlock (self->priv->lock);
+
+    return waiting;
+}
+
+void
+rate_limiter_forget (RateLimiter *self, CURL *curl)
+{
+    g_mutex_lock (self->priv->lock);
+
+    if (g_hash_table_remove (self->priv->paused, curl)) {
+        g_queue_remove (self->priv->waiting, curl);
+    }
+
+    g_mutex_unlock (self->priv->lock);
+}
@@ -0,0 +1,98 @@
+/*
+ *      rate-limiter.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#ifndef __RATE_LIMITER_H__
+#define __RATE_LIMITER_H__
+
+#include <glib-object.h>
+
+#include <curl/curl.h>
+
+#include "download.h"
+
+#define RATE_LIMITER_TYPE (rate_limiter_get_type ())
+#define RATE_LIMITER(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), RATE_LIMITER_TYPE, RateLimiter))
+#define RATE_LIMITER_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RATE_LIMITER_TYPE, RateLimiterClass))
+#define IS_RATE_LIMITER(object) (G_TYPE_CHECK_INSTANCE_TYPE ((object), RATE_LIMITER_TYPE))
+#define IS_RATE_LIMITER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), RATE_LIMITER_TYPE))
+#define RATE_LIMITER_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), RATE_LIMITER_TYPE, RateLimiterClass))
+
+// Paused transfers are reconsidered this often while any limit is hit,
+// in milliseconds
+#define RATE_LIMITER_TICK 50
+
+// A bucket holds at most this many milliseconds of its rate
+#define RATE_LIMITER_BURST 250
+
+G_BEGIN_DECLS
+
+typedef struct _RateLimiter RateLimiter;
+typedef struct _RateLimiterClass RateLimiterClass;
+typedef struct _RateLimiterPrivate RateLimiterPrivate;
+
+typedef struct _RateBucket RateBucket;
+
+struct _RateLimiter {
+    GObject parent;
+
+    RateLimiterPrivate *priv;
+};
+
+struct _RateLimiterClass {
+    GObjectClass parent;
+};
+
+/*
+ * Token buckets in three levels, global, group and download. Data is only
+ * accepted when every bucket above it has tokens left, rates are in bytes
+ * per second and 0 means unlimited.
+ */
+RateLimiter *rate_limiter_get_default (void);
+
+RateBucket *rate_limiter_get_global (RateLimiter *self);
+RateBucket *rate_limiter_bucket_new (RateLimiter *self, RateBucket *parent);
+void rate_limiter_bucket_free (RateLimiter *self, RateBucket *bucket);
+void rate_limiter_set_rate (RateLimiter *self, RateBucket *bucket, guint64 rate);
+
+void rate_limiter_attach (RateLimiter *self, Download *d, RateBucket *parent);
+void rate_limiter_detach (RateLimiter *self, Download *d);
+void rate_limiter_set_download_rate (RateLimiter *self, Download *d, guint64 rate);
+
+/*
+ * Called from write callbacks. Returns FALSE when a limit is hit, the
+ * callback then returns CURL_WRITEFUNC_PAUSE and curl is resumed by the
+ * transfer engine once tokens are available again.
+ */
+gboolean rate_limiter_consume (RateLimiter *self, Download *d, CURL *curl, gsize len);
+
+// Give back what consume took for a chunk curl will deliver again
+void rate_limiter_refund (RateLimiter *self, Download *d, gsize len);
+
+// For the transfer engine thread
+GSList *rate_limiter_tick (RateLimiter *self);
+gboolean rate_limiter_is_waiting (RateLimiter *self);
+void rate_limiter_forget (RateLimiter *self, CURL *curl);
+
+GType rate_limiter_get_type (void);
+
+G_END_DECLS
+
+#endif /* __RATE_LIMITER_H__ */
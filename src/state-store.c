@@ -0,0 +1,555 @@
+/*
+ *      state-store.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "state-store.h"
+
+#define STATE_STORE_MAGIC "GDMS"
+#define STATE_STORE_VERSION 2
+
+// Data length of a record removing its key, added in version 2
+#define STATE_STORE_REMOVED G_MAXUINT32
+
+G_DEFINE_TYPE (StateStore, state_store, G_TYPE_OBJECT)
+
+typedef struct _StoreHeader StoreHeader;
+struct _StoreHeader {
+    gchar magic[4];
+    guint32 version;
+};
+
+typedef struct _RecordHeader RecordHeader;
+struct _RecordHeader {
+    guint32 key_len;
+    guint32 data_len;
+};
+
+typedef struct _StateEntry StateEntry;
+struct _StateEntry {
+    gchar *data;
+    gsize len;
+};
+
+typedef struct _StateRecord StateRecord;
+struct _StateRecord {
+    gchar *key;
+    StateEntry *entry;
+};
+
+struct _StateStorePrivate {
+    gchar *path;
+    gint fd;
+
+    // Latest record of every key
+    GHashTable *entries;
+
+    // Bytes in the log and bytes of its records still current
+    gsize size, live;
+
+    // Set when the file on disk could not be read, it is left alone and
+    // changes are only kept in memory
+    gboolean broken;
+
+    // While a compaction writes the entries of snapshot aside, records
+    // appended meanwhile are kept in pending to be added to the new log
+    gboolean compacting;
+    GSList *snapshot;
+    GString *pending;
+
+    GMutex *lock;
+};
+
+static StateStore *instance = NULL;
+
+static void state_store_load (StateStore *self);
+static gpointer state_store_compact (StateStore *self);
+
+static void
+state_entry_free (StateEntry *e)
+{
+    g_free (e->data);
+    g_free (e);
+}
+
+static void
+state_store_finalize (GObject *object)
+{
+    StateStore *self = STATE_STORE (object);
+
+    if (self->priv->fd != -1) {
+        close (self->priv->fd);
+    }
+
+    g_hash_table_destroy (self->priv->entries);
+    g_mutex_free (self->priv->lock);
+    g_free (self->priv->path);
+
+    G_OBJECT_CLASS (state_store_parent_class)->finalize (object);
+}
+
+static void
+state_store_class_init (StateStoreClass *klass)
+{
+    GObjectClass *object_class;
+    object_class = G_OBJECT_CLASS (klass);
+
+    g_type_class_add_private ((gpointer) klass, sizeof (StateStorePrivate));
+
+    object_class->finalize = state_store_finalize;
+}
+
+static void
+state_store_init (StateStore *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), STATE_STORE_TYPE, StateStorePrivate);
+
+    gchar *dir = g_build_filename (g_get_user_config_dir (), "gdman", NULL);
+    g_mkdir_with_parents (dir, 0755);
+
+    self->priv->path = g_build_filename (dir, "state.db", NULL);
+    self->priv->fd = -1;
+    self->priv->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+        g_free, (GDestroyNotify) state_entry_free);
+    self->priv->size = 0;
+    self->priv->live = 0;
+    self->priv->lock = g_mutex_new ();
+
+    g_free (dir);
+
+    state_store_load (self);
+}
+
+StateStore*
+state_store_get_default (void)
+{
+    static gsize once = 0;
+
+    // First used by the loader thread, other threads wait for it to load
+    if (g_once_init_enter (&once)) {
+        instance = g_object_new (STATE_STORE_TYPE, NULL);
+        g_once_init_leave (&once, 1);
+    }
+
+    return instance;
+}
+
+static gboolean
+state_store_write_all (gint fd, gconstpointer data, gsize len)
+{
+    const gchar *buff = data;
+
+    while (len > 0) {
+        gssize n = write (fd, buff, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return FALSE;
+        }
+
+        buff += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+static gsize
+state_store_record_size (const gchar *key, gsize len)
+{
+    return sizeof (RecordHeader) + strlen (key) + (len == STATE_STORE_REMOVED ? 0 : len);
+}
+
+static void
+state_store_index (StateStore *self, const gchar *key, const gchar *data, gsize len)
+{
+    StateEntry *old = g_hash_table_lookup (self->priv->entries, key);
+    StateEntry *e = g_new0 (StateEntry, 1);
+
+    if (old) {
+        self->priv->live -= state_store_record_size (key, old->len);
+    }
+
+    e->data = g_strndup (data, len);
+    e->len = len;
+
+    g_hash_table_replace (self->priv->entries, g_strdup (key), e);
+    self->priv->live += state_store_record_size (key, len);
+}
+
+static gboolean
+state_store_unindex (StateStore *self, const gchar *key)
+{
+    StateEntry *old = g_hash_table_lookup (self->priv->entries, key);
+
+    if (!old) {
+        return FALSE;
+    }
+
+    self->priv->live -= state_store_record_size (key, old->len);
+    g_hash_table_remove (self->priv->entries, key);
+
+    return TRUE;
+}
+
+// Record replacing key with data, or removing it when len is
+// STATE_STORE_REMOVED
+static GString*
+state_store_record_new (const gchar *key, const gchar *data, gsize len)
+{
+    RecordHeader header;
+    GString *record;
+
+    header.key_len = strlen (key);
+    header.data_len = len;
+
+    record = g_string_sized_new (state_store_record_size (key, len));
+    g_string_append_len (record, (const gchar*) &header, sizeof (header));
+    g_string_append_len (record, key, header.key_len);
+
+    if (len != STATE_STORE_REMOVED) {
+        g_string_append_len (record, data, len);
+    }
+
+    return record;
+}
+
+static gboolean
+state_store_append (gint fd, const gchar *key, const gchar *data, gsize len)
+{
+    // One write per record so a crash can only tear the last one
+    GString *record = state_store_record_new (key, data, len);
+    gboolean ret = state_store_write_all (fd, record->str, record->len);
+
+    g_string_free (record, TRUE);
+
+    return ret;
+}
+
+// Copy of every entry, taken with the lock held
+static GSList*
+state_store_snapshot (StateStore *self)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GSList *records = NULL;
+
+    g_hash_table_iter_init (&iter, self->priv->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        StateEntry *e = value;
+        StateRecord *r = g_new0 (StateRecord, 1);
+
+        r->key = g_strdup (key);
+        r->entry = g_new0 (StateEntry, 1);
+        r->entry->data = g_strndup (e->data, e->len);
+        r->entry->len = e->len;
+
+        records = g_slist_prepend (records, r);
+    }
+
+    return records;
+}
+
+static void
+state_record_free (StateRecord *r)
+{
+    g_free (r->key);
+    state_entry_free (r->entry);
+    g_free (r);
+}
+
+/*
+ * Start a compaction if none is running and the file may be replaced,
+ * the lock must be held. state_store_compact does the writing after.
+ */
+static gboolean
+state_store_begin_compact (StateStore *self)
+{
+    StateStorePrivate *priv = self->priv;
+
+    if (priv->compacting || priv->broken) {
+        return FALSE;
+    }
+
+    priv->compacting = TRUE;
+    priv->snapshot = state_store_snapshot (self);
+    priv->pending = g_string_new (NULL);
+
+    return TRUE;
+}
+
+static gboolean
+state_store_should_compact (StateStore *self)
+{
+    return self->priv->size > STATE_STORE_COMPACT_SIZE && self->priv->size > 2 * self->priv->live;
+}
+
+static void
+state_store_load (StateStore *self)
+{
+    StateStorePrivate *priv = self->priv;
+    gboolean upgrade = FALSE;
+    gchar *data;
+    gsize len, pos;
+
+    if (g_file_get_contents (priv->path, &data, &len, NULL)) {
+        StoreHeader *h = (StoreHeader*) data;
+
+        if (len >= sizeof (StoreHeader) && !memcmp (h->magic, STATE_STORE_MAGIC, 4) &&
+            h->version >= 1 && h->version <= STATE_STORE_VERSION) {
+            pos = sizeof (StoreHeader);
+
+            while (pos + sizeof (RecordHeader) <= len) {
+                RecordHeader r;
+                memcpy (&r, data + pos, sizeof (r));
+
+                gsize rlen = sizeof (RecordHeader) + r.key_len +
+                    (r.data_len == STATE_STORE_REMOVED ? 0 : r.data_len);
+                if (pos + rlen > len) {
+                    break;
+                }
+
+                gchar *key = g_strndup (data + pos + sizeof (RecordHeader), r.key_len);
+                if (r.data_len == STATE_STORE_REMOVED) {
+                    state_store_unindex (self, key);
+                } else {
+                    state_store_index (self, key,
+                        data + pos + sizeof (RecordHeader) + r.key_len, r.data_len);
+                }
+                g_free (key);
+
+                pos += rlen;
+            }
+
+            priv->size = pos;
+
+            // Older logs are rewritten before records they lack get appended
+            upgrade = h->version != STATE_STORE_VERSION;
+        } else {
+            // Possibly written by a newer version, do not replace it
+            g_print ("Unknown state file %s, changes will not be saved\n", priv->path);
+            priv->broken = TRUE;
+        }
+
+        g_free (data);
+    } else if (g_file_test (priv->path, G_FILE_TEST_EXISTS)) {
+        g_print ("Unable to read state file %s, changes will not be saved\n", priv->path);
+        priv->broken = TRUE;
+    }
+
+    if (priv->broken) {
+        return;
+    }
+
+    if (priv->size > 0) {
+        // Drop a record torn by a crash so appends start on a boundary
+        priv->fd = g_open (priv->path, O_WRONLY, 0644);
+        if (priv->fd != -1 && (ftruncate (priv->fd, priv->size) != 0 ||
+            lseek (priv->fd, priv->size, SEEK_SET) == -1)) {
+            close (priv->fd);
+            priv->fd = -1;
+        }
+    }
+
+    // Still loading, no other thread uses the store yet
+    if (priv->fd == -1 || upgrade || state_store_should_compact (self)) {
+        state_store_begin_compact (self);
+        state_store_compact (self);
+    }
+}
+
+/*
+ * Write the snapshot aside and swap it in. Only the swap takes the lock,
+ * so puts and removes go on while the new log is written and synced.
+ */
+static gpointer
+state_store_compact (StateStore *self)
+{
+    StateStorePrivate *priv = self->priv;
+    gchar *tmp = g_strconcat (priv->path, ".tmp", NULL);
+    StoreHeader header;
+    gsize size = sizeof (header);
+    GSList *l;
+    gboolean ok;
+    gint fd;
+
+    memcpy (header.magic, STATE_STORE_MAGIC, 4);
+    header.version = STATE_STORE_VERSION;
+
+    fd = g_open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd != -1 && state_store_write_all (fd, &header, sizeof (header));
+
+    for (l = priv->snapshot; l; l = l->next) {
+        StateRecord *r = l->data;
+
+        if (ok) {
+            ok = state_store_append (fd, r->key, r->entry->data, r->entry->len);
+            size += state_store_record_size (r->key, r->entry->len);
+        }
+
+        state_record_free (r);
+    }
+
+    g_slist_free (priv->snapshot);
+    priv->snapshot = NULL;
+
+    // The new log replaces the old one only once it is safely on disk
+    ok = ok && fdatasync (fd) == 0;
+
+    g_mutex_lock (priv->lock);
+
+    if (ok && state_store_write_all (fd, priv->pending->str, priv->pending->len) &&
+        g_rename (tmp, priv->path) == 0) {
+        if (priv->fd != -1) {
+            close (priv->fd);
+        }
+
+        priv->fd = fd;
+        priv->size = size + priv->pending->len;
+    } else {
+        g_print ("Error writing %s: %s\n", priv->path, g_strerror (errno));
+
+        if (fd != -1) {
+            close (fd);
+        }
+        g_unlink (tmp);
+    }
+
+    g_string_free (priv->pending, TRUE);
+    priv->pending = NULL;
+    priv->compacting = FALSE;
+
+    g_mutex_unlock (priv->lock);
+
+    g_free (tmp);
+
+    return NULL;
+}
+
+// Append the record for key and compact when due, the lock must be held.
+// Returns TRUE when a compaction was started for the caller to run.
+static gboolean
+state_store_log (StateStore *self, const gchar *key, const gchar *data, gsize len)
+{
+    StateStorePrivate *priv = self->priv;
+
+    if (priv->broken) {
+        return FALSE;
+    }
+
+    if (priv->fd != -1 && state_store_append (priv->fd, key, data, len)) {
+        priv->size += state_store_record_size (key, len);
+    } else {
+        g_print ("Error saving %s to %s\n", key, priv->path);
+    }
+
+    if (priv->pending) {
+        GString *record = state_store_record_new (key, data, len);
+        g_string_append_len (priv->pending, record->str, record->len);
+        g_string_free (record, TRUE);
+    }
+
+    return state_store_should_compact (self) && state_store_begin_compact (self);
+}
+
+// Rewriting and syncing the log takes long, keep it off the calling thread
+static void
+state_store_run_compact (StateStore *self)
+{
+    if (!g_thread_create ((GThreadFunc) state_store_compact, self, FALSE, NULL)) {
+        state_store_compact (self);
+    }
+}
+
+void
+state_store_put (StateStore *self, const gchar *key, const gchar *data, gsize len)
+{
+    StateStorePrivate *priv = self->priv;
+    gboolean compact;
+
+    g_mutex_lock (priv->lock);
+
+    state_store_index (self, key, data, len);
+    compact = state_store_log (self, key, data, len);
+
+    g_mutex_unlock (priv->lock);
+
+    if (compact) {
+        state_store_run_compact (self);
+    }
+}
+
+void
+state_store_remove (StateStore *self, const gchar *key)
+{
+    StateStorePrivate *priv = self->priv;
+    gboolean compact = FALSE;
+
+    g_mutex_lock (priv->lock);
+
+    if (state_store_unindex (self, key)) {
+        compact = state_store_log (self, key, NULL, STATE_STORE_REMOVED);
+    }
+
+    g_mutex_unlock (priv->lock);
+
+    if (compact) {
+        state_store_run_compact (self);
+    }
+}
+
+void
+state_store_foreach (StateStore *self, StateStoreFunc func, gpointer user_data)
+{
+    GSList *records, *l;
+
+    // Callbacks may put records themselves, walk a copy outside the lock
+    g_mutex_lock (self->priv->lock);
+    records = state_store_snapshot (self);
+    g_mutex_unlock (self->priv->lock);
+
+    for (l = records; l; l = l->next) {
+        StateRecord *r = l->data;
+
+        func (r->key, r->entry->data, r->entry->len, user_data);
+        state_record_free (r);
+    }
+
+    g_slist_free (records);
+}
+
+void
+state_store_sync (StateStore *self)
+{
+    g_mutex_lock (self->priv->lock);
+
+    if (self->priv->fd != -1) {
+        fdatasync (self->priv->fd);
+    }
+
+    g_mutex_unlock (self->priv->lock);
+}
@@ -0,0 +1,73 @@
+/*
+ *      state-store.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#ifndef __STATE_STORE_H__
+#define __STATE_STORE_H__
+
+#include <glib-object.h>
+
+#define STATE_STORE_TYPE (state_store_get_type ())
+#define STATE_STORE(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), STATE_STORE_TYPE, StateStore))
+#define STATE_STORE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), STATE_STORE_TYPE, StateStoreClass))
+#define IS_STATE_STORE(object) (G_TYPE_CHECK_INSTANCE_TYPE ((object), STATE_STORE_TYPE))
+#define IS_STATE_STORE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), STATE_STORE_TYPE))
+#define STATE_STORE_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), STATE_STORE_TYPE, StateStoreClass))
+
+// The log is rewritten once it is larger than this and more than half of
+// it holds replaced records
+#define STATE_STORE_COMPACT_SIZE (1024 * 1024)
+
+G_BEGIN_DECLS
+
+typedef struct _StateStore StateStore;
+typedef struct _StateStoreClass StateStoreClass;
+typedef struct _StateStorePrivate StateStorePrivate;
+
+typedef void (*StateStoreFunc) (const gchar *key, const gchar *data, gsize len, gpointer user_data);
+
+struct _StateStore {
+    GObject parent;
+
+    StateStorePrivate *priv;
+};
+
+struct _StateStoreClass {
+    GObjectClass parent;
+};
+
+/*
+ * All saved downloads live in one append-only log, state.db in the config
+ * directory. It is read in one pass at start and every put appends a record
+ * replacing the previous one with the same key, every remove one dropping
+ * it. The log is compacted on a thread of its own.
+ */
+StateStore *state_store_get_default (void);
+
+void state_store_put (StateStore *self, const gchar *key, const gchar *data, gsize len);
+void state_store_remove (StateStore *self, const gchar *key);
+void state_store_foreach (StateStore *self, StateStoreFunc func, gpointer user_data);
+void state_store_sync (StateStore *self);
+
+GType state_store_get_type (void);
+
+G_END_DECLS
+
+#endif /* __STATE_STORE_H__ */
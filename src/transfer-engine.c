@@ -0,0 +1,387 @@
+/*
+ *      transfer-engine.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+#include "transfer-engine.h"
+
+#include "rate-limiter.h"
+
+G_DEFINE_TYPE (TransferEngine, transfer_engine, G_TYPE_OBJECT)
+
+typedef struct _Transfer Transfer;
+struct _Transfer {
+    CURL *curl;
+    GObject *owner;
+    TransferDoneFunc done;
+    gpointer user_data;
+};
+
+struct _TransferEnginePrivate {
+    CURLM *multi;
+    GThread *thread;
+
+    // Transfers waiting to be handed to the multi handle, filled from any
+    // thread and drained by the engine thread
+    GAsyncQueue *pending;
+
+    // Paused transfers to continue, curl_easy_pause must be called from
+    // the engine thread
+    GAsyncQueue *resume;
+
+    // CURL* -> Transfer for every handle owned by the multi handle
+    GHashTable *transfers;
+
+    // DNS cache, TLS sessions and connections shared by all handles
+    CURLSH *share;
+    GMutex *share_locks[CURL_LOCK_DATA_LAST];
+
+    GAsyncQueue *pool;
+
+    // Host names last seen speaking HTTP/2, read by the schedulers
+    GHashTable *multiplexed;
+    GMutex *multiplexed_lock;
+
+    volatile gint running;
+};
+
+static TransferEngine *instance = NULL;
+
+static gpointer transfer_engine_main (TransferEngine *self);
+
+static void
+transfer_engine_finalize (GObject *object)
+{
+    TransferEngine *self = TRANSFER_ENGINE (object);
+
+    transfer_engine_shutdown (self);
+
+    g_hash_table_destroy (self->priv->transfers);
+    g_async_queue_unref (self->priv->pending);
+    g_async_queue_unref (self->priv->resume);
+    curl_multi_cleanup (self->priv->multi);
+
+    CURL *curl;
+    while ((curl = g_async_queue_try_pop (self->priv->pool))) {
+        curl_easy_cleanup (curl);
+    }
+    g_async_queue_unref (self->priv->pool);
+
+    g_hash_table_destroy (self->priv->multiplexed);
+    g_mutex_free (self->priv->multiplexed_lock);
+
+    curl_share_cleanup (self->priv->share);
+
+    gint i;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        g_mutex_free (self->priv->share_locks[i]);
+    }
+
+    G_OBJECT_CLASS (transfer_engine_parent_class)->finalize (object);
+}
+
+static void
+transfer_engine_class_init (TransferEngineClass *klass)
+{
+    GObjectClass *object_class;
+    object_class = G_OBJECT_CLASS (klass);
+
+    g_type_class_add_private ((gpointer) klass, sizeof (TransferEnginePrivate));
+
+    object_class->finalize = transfer_engine_finalize;
+
+    curl_global_init (CURL_GLOBAL_ALL);
+}
+
+static void
+transfer_engine_share_lock (CURL *curl, curl_lock_data data, curl_lock_access access, TransferEngine *self)
+{
+    g_mutex_lock (self->priv->share_locks[data]);
+}
+
+static void
+transfer_engine_share_unlock (CURL *curl, curl_lock_data data, TransferEngine *self)
+{
+    g_mutex_unlock (self->priv->share_locks[data]);
+}
+
+static void
+transfer_engine_init (TransferEngine *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), TRANSFER_ENGINE_TYPE, TransferEnginePrivate);
+
+    self->priv->multi = curl_multi_init ();
+    self->priv->pending = g_async_queue_new ();
+    self->priv->resume = g_async_queue_new ();
+    self->priv->transfers = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+    self->priv->pool = g_async_queue_new ();
+
+    self->priv->multiplexed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    self->priv->multiplexed_lock = g_mutex_new ();
+
+    // Transfers to one origin become streams of a single connection
+    // wherever the server speaks HTTP/2
+    curl_multi_setopt (self->priv->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    gint i;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        self->priv->share_locks[i] = g_mutex_new ();
+    }
+
+    self->priv->share = curl_share_init ();
+    curl_share_setopt (self->priv->share, CURLSHOPT_LOCKFUNC, transfer_engine_share_lock);
+    curl_share_setopt (self->priv->share, CURLSHOPT_UNLOCKFUNC, transfer_engine_share_unlock);
+    curl_share_setopt (self->priv->share, CURLSHOPT_USERDATA, self);
+    curl_share_setopt (self->priv->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt (self->priv->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt (self->priv->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    self->priv->running = TRUE;
+    self->priv->thread = g_thread_create ((GThreadFunc) transfer_engine_main,
+        self, TRUE, NULL);
+}
+
+TransferEngine*
+transfer_engine_get_default (void)
+{
+    static gsize once = 0;
+
+    // Used from the engine and resolve threads as well as the main loop
+    if (g_once_init_enter (&once)) {
+        instance = g_object_new (TRANSFER_ENGINE_TYPE, NULL);
+        g_once_init_leave (&once, 1);
+    }
+
+    return instance;
+}
+
+void
+transfer_engine_add (TransferEngine *self, CURL *curl, GObject *owner,
+    TransferDoneFunc done, gpointer user_data)
+{
+    Transfer *t = g_new0 (Transfer, 1);
+
+    t->curl = curl;
+    t->owner = owner ? g_object_ref (owner) : NULL;
+    t->done = done;
+    t->user_data = user_data;
+
+    curl_easy_setopt (curl, CURLOPT_SHARE, self->priv->share);
+
+    // Ask for HTTP/2 where TLS can negotiate it, plain http stays on 1.1
+    // without an Upgrade header. Wait for a connection being set up to the
+    // same origin rather than opening another, it may turn out to take streams.
+    curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt (curl, CURLOPT_PIPEWAIT, 1L);
+
+    g_async_queue_push (self->priv->pending, t);
+    curl_multi_wakeup (self->priv->multi);
+}
+
+void
+transfer_engine_resume (TransferEngine *self, CURL *curl)
+{
+    g_async_queue_push (self->priv->resume, curl);
+    curl_multi_wakeup (self->priv->multi);
+}
+
+CURL*
+transfer_engine_get_handle (TransferEngine *self)
+{
+    CURL *curl = g_async_queue_try_pop (self->priv->pool);
+
+    if (!curl) {
+        curl = curl_easy_init ();
+    }
+
+    return curl;
+}
+
+void
+transfer_engine_release_handle (TransferEngine *self, CURL *curl)
+{
+    if (g_async_queue_length (self->priv->pool) < TRANSFER_ENGINE_POOL_SIZE) {
+        // Reset drops the options but keeps the caches and connections
+        curl_easy_reset (curl);
+        g_async_queue_push (self->priv->pool, curl);
+    } else {
+        curl_easy_cleanup (curl);
+    }
+}
+
+gboolean
+transfer_engine_is_multiplexed (TransferEngine *self, const gchar *host)
+{
+    gboolean ret;
+
+    if (!host) {
+        return FALSE;
+    }
+
+    g_mutex_lock (self->priv->multiplexed_lock);
+    ret = g_hash_table_lookup (self->priv->multiplexed, host) != NULL;
+    g_mutex_unlock (self->priv->multiplexed_lock);
+
+    return ret;
+}
+
+/*
+ * Remember which protocol the host of a finished transfer spoke, keyed by
+ * the host name without the port like the download groups do.
+ */
+static void
+transfer_engine_note_protocol (TransferEngine *self, CURL *curl)
+{
+    glong version = 0;
+    gchar *url = NULL;
+
+    curl_easy_getinfo (curl, CURLINFO_HTTP_VERSION, &version);
+    curl_easy_getinfo (curl, CURLINFO_EFFECTIVE_URL, &url);
+
+    if (version == 0 || !url || !strstr (url, "://")) {
+        return;
+    }
+
+    const gchar *start = strstr (url, "://") + 3;
+    gchar *host = g_ascii_strdown (start, strcspn (start, ":/?#"));
+
+    g_mutex_lock (self->priv->multiplexed_lock);
+    if (version >= CURL_HTTP_VERSION_2_0) {
+        g_hash_table_replace (self->priv->multiplexed, host, GINT_TO_POINTER (TRUE));
+    } else {
+        g_hash_table_remove (self->priv->multiplexed, host);
+        g_free (host);
+    }
+    g_mutex_unlock (self->priv->multiplexed_lock);
+}
+
+void
+transfer_engine_shutdown (TransferEngine *self)
+{
+    if (!self->priv->thread) {
+        return;
+    }
+
+    g_atomic_int_set (&self->priv->running, FALSE);
+    curl_multi_wakeup (self->priv->multi);
+
+    g_thread_join (self->priv->thread);
+    self->priv->thread = NULL;
+}
+
+gboolean
+transfer_engine_is_running (TransferEngine *self)
+{
+    return g_atomic_int_get (&self->priv->running);
+}
+
+static void
+transfer_engine_finish (TransferEngine *self, Transfer *t, CURLcode res)
+{
+    curl_multi_remove_handle (self->priv->multi, t->curl);
+    g_hash_table_steal (self->priv->transfers, t->curl);
+    rate_limiter_forget (rate_limiter_get_default (), t->curl);
+
+    // Stopped and failed transfers count too as long as a response came
+    transfer_engine_note_protocol (self, t->curl);
+
+    if (t->done) {
+        t->done (t->curl, res, t->user_data);
+    }
+
+    if (t->owner) {
+        g_object_unref (t->owner);
+    }
+
+    g_free (t);
+}
+
+static gpointer
+transfer_engine_main (TransferEngine *self)
+{
+    TransferEnginePrivate *priv = self->priv;
+    RateLimiter *limiter = rate_limiter_get_default ();
+    GSList *resume, *r;
+    Transfer *t;
+    CURL *curl;
+    CURLMsg *msg;
+    gint running, left;
+
+    while (g_atomic_int_get (&priv->running)) {
+        while ((t = g_async_queue_try_pop (priv->pending))) {
+            g_hash_table_insert (priv->transfers, t->curl, t);
+            curl_multi_add_handle (priv->multi, t->curl);
+        }
+
+        while ((curl = g_async_queue_try_pop (priv->resume))) {
+            if (g_hash_table_lookup (priv->transfers, curl)) {
+                curl_easy_pause (curl, CURLPAUSE_CONT);
+            }
+        }
+
+        // Refill the rate limits and continue the handles they allow
+        resume = rate_limiter_tick (limiter);
+        for (r = resume; r; r = r->next) {
+            if (g_hash_table_lookup (priv->transfers, r->data)) {
+                curl_easy_pause (r->data, CURLPAUSE_CONT);
+            }
+        }
+        g_slist_free (resume);
+
+        curl_multi_perform (priv->multi, &running);
+
+        while ((msg = curl_multi_info_read (priv->multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+
+            t = g_hash_table_lookup (priv->transfers, msg->easy_handle);
+            if (t) {
+                transfer_engine_finish (self, t, msg->data.result);
+            }
+        }
+
+        curl_multi_poll (priv->multi, NULL, 0,
+            rate_limiter_is_waiting (limiter) ? RATE_LIMITER_TICK : 1000, NULL);
+    }
+
+    // Drop whatever is still in flight so the owners can close their files,
+    // until done callbacks stop adding transfers of their own
+    GList *list, *iter;
+    gboolean dropped;
+    do {
+        while ((t = g_async_queue_try_pop (priv->pending))) {
+            g_hash_table_insert (priv->transfers, t->curl, t);
+            curl_multi_add_handle (priv->multi, t->curl);
+        }
+
+        list = g_hash_table_get_values (priv->transfers);
+        dropped = list != NULL;
+
+        for (iter = list; iter; iter = iter->next) {
+            transfer_engine_finish (self, iter->data, CURLE_ABORTED_BY_CALLBACK);
+        }
+        g_list_free (list);
+    } while (dropped);
+
+    return NULL;
+}
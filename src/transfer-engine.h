@@ -0,0 +1,87 @@
+/*
+ *      transfer-engine.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#ifndef __TRANSFER_ENGINE_H__
+#define __TRANSFER_ENGINE_H__
+
+#include <glib-object.h>
+
+#include <curl/curl.h>
+
+#define TRANSFER_ENGINE_TYPE (transfer_engine_get_type ())
+#define TRANSFER_ENGINE(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), TRANSFER_ENGINE_TYPE, TransferEngine))
+#define TRANSFER_ENGINE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), TRANSFER_ENGINE_TYPE, TransferEngineClass))
+#define IS_TRANSFER_ENGINE(object) (G_TYPE_CHECK_INSTANCE_TYPE ((object), TRANSFER_ENGINE_TYPE))
+#define IS_TRANSFER_ENGINE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), TRANSFER_ENGINE_TYPE))
+#define TRANSFER_ENGINE_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), TRANSFER_ENGINE_TYPE, TransferEngineClass))
+
+// Released easy handles kept for reuse, the rest are cleaned up
+#define TRANSFER_ENGINE_POOL_SIZE 32
+
+G_BEGIN_DECLS
+
+typedef struct _TransferEngine TransferEngine;
+typedef struct _TransferEngineClass TransferEngineClass;
+typedef struct _TransferEnginePrivate TransferEnginePrivate;
+
+/*
+ * Called from the engine thread once a transfer has finished. res is
+ * CURLE_ABORTED_BY_CALLBACK for transfers dropped by transfer_engine_shutdown.
+ */
+typedef void (*TransferDoneFunc) (CURL *curl, CURLcode res, gpointer user_data);
+
+struct _TransferEngine {
+    GObject parent;
+
+    TransferEnginePrivate *priv;
+};
+
+struct _TransferEngineClass {
+    GObjectClass parent;
+};
+
+TransferEngine *transfer_engine_get_default (void);
+
+// owner is kept alive until done has returned
+void transfer_engine_add (TransferEngine *self, CURL *curl, GObject *owner,
+    TransferDoneFunc done, gpointer user_data);
+void transfer_engine_resume (TransferEngine *self, CURL *curl);
+void transfer_engine_shutdown (TransferEngine *self);
+
+// FALSE once shutdown began, done callbacks then must not add transfers
+gboolean transfer_engine_is_running (TransferEngine *self);
+
+/*
+ * Easy handles come from a pool and share DNS, TLS sessions and open
+ * connections with every other transfer, release them once done with.
+ */
+CURL *transfer_engine_get_handle (TransferEngine *self);
+void transfer_engine_release_handle (TransferEngine *self, CURL *curl);
+
+// Whether the last transfer to host that got a response ran as a stream of
+// a HTTP/2 connection
+gboolean transfer_engine_is_multiplexed (TransferEngine *self, const gchar *host);
+
+GType transfer_engine_get_type (void);
+
+G_END_DECLS
+
+#endif /* __TRANSFER_ENGINE_H__ */
@@ -19,17 +19,24 @@
  *      MA 02110-1301, USA.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 
+#include <glib/gstdio.h>
 #include <curl/curl.h>
 
 #include "youtube-download.h"
 
 #include "http-download.h"
+#include "disk-writer.h"
 #include "download.h"
+#include "range-journal.h"
+#include "rate-limiter.h"
+#include "state-store.h"
+#include "transfer-engine.h"
 
 static void download_init (DownloadInterface *iface);
 G_DEFINE_TYPE_WITH_CODE (YoutubeDownload, youtube_download, G_TYPE_OBJECT,
@@ -41,44 +48,99 @@ enum {
     YOUTUBE_STAGE_DFILE,
 };
 
+// Where the scan of the get_video_info response is, it is a single
+// urlencoded line of key=value pairs
+enum {
+    YOUTUBE_SCAN_KEY = 0,
+    YOUTUBE_SCAN_SKIP,
+    YOUTUBE_SCAN_MAP,
+    YOUTUBE_SCAN_DONE,
+};
+
+// Keys are short, longer ones are only kept up to this length
+#define YOUTUBE_MAX_KEY 32
+
+// Seconds a resolved media url is used before get_video_info is asked
+// again, the server may still refuse it earlier
+#define YOUTUBE_URL_TTL (4 * 60 * 60)
+
 struct _YoutubeDownloadPrivate {
     gchar *source, *dest;
 
-    gchar *buff;
-    gint buff_pos;
+    // Saved state record, named when the download is first created
+    gchar *key;
+
+    // Media url of the best format and when it was resolved, kept with the
+    // saved download. cached is set while a request uses a saved url.
+    gchar *url;
+    gint fmt;
+    gint64 resolved;
+    gboolean cached, resolve;
+
+    // DOWNLOAD_RESOLVE_* while the url is resolved ahead of the start
+    volatile gint resolving;
+
+    // Key being read, or the fmt_url_map value once its key was seen
+    GString *token;
+    gint scan;
 
-    gint size, completed;
+    goffset size, completed;
 
-    FILE *fptr;
+    // Set until the headers of the file response decided how to go on,
+    // restart when they showed the saved progress is of no use
+    gboolean probing, restart;
+    goffset length, range_start, range_total;
+    RangeJournal *journal;
+
+    // How the file transfer ended, settled once the file is on disk
+    CURLcode result;
+
+    DiskFile *file;
+    DiskStream *out;
     CURL *curl;
-    GThread *main;
     time_t ot;
 
+    // Bytes per second, published once a second by the engine thread
+    volatile gint rate;
+
     gint state, stage;
 };
 
 static gchar *youtube_download_get_title (Download *self);
-static gint youtube_download_get_size_total (Download *self);
-static gint youtube_download_get_size_completed (Download *self);
+static const gchar *youtube_download_get_source (Download *self);
+static goffset youtube_download_get_size_total (Download *self);
+static goffset youtube_download_get_size_completed (Download *self);
 static gint youtube_download_get_time_total (Download *self);
 static gint youtube_download_get_time_remaining (Download *self);
 static gboolean youtube_download_get_state (Download *self);
 static gboolean youtube_download_start (Download *self);
+static gboolean youtube_download_queue (Download *self);
 static gboolean youtube_download_stop (Download *self);
 static gboolean youtube_download_cancel (Download *self);
 static gboolean youtube_download_pause (Download *self);
+static gboolean youtube_download_resolve (Download *self);
 static gboolean youtube_download_export_to_file (Download *self);
+static gboolean youtube_download_forget (Download *self);
 
 gboolean youtube_timeout (YoutubeDownload *self);
-gpointer youtube_download_main (YoutubeDownload *self);
+
+static void youtube_download_info_done (CURL *curl, CURLcode res, YoutubeDownload *self);
+static void youtube_download_request_info (YoutubeDownload *self);
+static void youtube_download_fetch_file (YoutubeDownload *self);
+static gboolean youtube_download_begin (YoutubeDownload *self, glong code);
+static void youtube_download_done (CURL *curl, CURLcode res, YoutubeDownload *self);
+static void youtube_download_written (gboolean ok, YoutubeDownload *self);
+static void youtube_download_allocated (gboolean ok, YoutubeDownload *self);
 
 static size_t youtube_write_data (char *buff, size_t size, size_t num, YoutubeDownload *self);
+static size_t youtube_header_data (char *buff, size_t size, size_t num, YoutubeDownload *self);
 static int youtube_download_progress (YoutubeDownload *self, gdouble dt, gdouble dn, gdouble ut, gdouble un);
 
 static void
 download_init (DownloadInterface *iface)
 {
     iface->get_title = youtube_download_get_title;
+    iface->get_source = youtube_download_get_source;
 
     iface->get_size_tot = youtube_download_get_size_total;
     iface->get_size_comp = youtube_download_get_size_completed;
@@ -89,11 +151,14 @@ download_init (DownloadInterface *iface)
     iface->get_state = youtube_download_get_state;
 
     iface->start = youtube_download_start;
+    iface->queue = youtube_download_queue;
     iface->stop = youtube_download_stop;
     iface->cancel = youtube_download_cancel;
     iface->pause = youtube_download_pause;
+    iface->resolve = youtube_download_resolve;
 
     iface->export = youtube_download_export_to_file;
+    iface->forget = youtube_download_forget;
 }
 
 static void
@@ -101,6 +166,9 @@ youtube_download_finalize (GObject *object)
 {
     YoutubeDownload *self = YOUTUBE_DOWNLOAD (object);
 
+    g_free (self->priv->key);
+    g_string_free (self->priv->token, TRUE);
+
     G_OBJECT_CLASS (youtube_download_parent_class)->finalize (object);
 }
 
@@ -119,6 +187,17 @@ static void
 youtube_download_init (YoutubeDownload *self)
 {
     self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), YOUTUBE_DOWNLOAD_TYPE, YoutubeDownloadPrivate);
+
+    self->priv->token = g_string_new (NULL);
+    self->priv->scan = YOUTUBE_SCAN_KEY;
+}
+
+void
+youtube_download_register (DownloadRegistry *registry)
+{
+    download_registry_add_type (registry, YOUTUBE_DOWNLOAD_TAG,
+        youtube_download_new, youtube_download_new_from_data);
+    download_registry_add_host (registry, ".youtube.com", YOUTUBE_DOWNLOAD_TAG);
 }
 
 Download*
@@ -128,30 +207,38 @@ youtube_download_new (const gchar *source, const gchar *dest)
 
     self->priv->source = g_strdup (source);
     self->priv->dest = g_strdup (dest);
+    self->priv->key = _download_make_key (source, dest, YOUTUBE_DOWNLOAD_TAG);
 
     return DOWNLOAD (self);
 }
 
 Download*
-youtube_download_new_from_file (const gchar *filename)
+youtube_download_new_from_data (const gchar *key, const gchar *data, gsize len)
 {
     GError *err = NULL;
     GKeyFile *kf = g_key_file_new ();
 
     YoutubeDownload *self = g_object_new (YOUTUBE_DOWNLOAD_TYPE, NULL);
 
-    g_key_file_load_from_file (kf, filename, G_KEY_FILE_NONE, &err);
+    g_key_file_load_from_data (kf, data, len, G_KEY_FILE_NONE, &err);
 
     if (err) {
-        g_print ("Error loading %s: %s\n", filename, err->message);
+        g_print ("Error loading download: %s\n", err->message);
         g_error_free (err);
         err = NULL;
     }
 
+    self->priv->key = g_strdup (key);
     self->priv->source = g_key_file_get_string (kf, "Download", "Source", NULL);
     self->priv->dest = g_key_file_get_string (kf, "Download", "Destination", NULL);
-    self->priv->size = g_key_file_get_integer (kf, "Dowload", "Size", NULL);
-    self->priv->completed = g_key_file_get_integer (kf, "Download", "Completed", NULL);
+    self->priv->size = g_key_file_get_int64 (kf, "Download", "Size", NULL);
+    self->priv->completed = g_key_file_get_int64 (kf, "Download", "Completed", NULL);
+
+    self->priv->url = g_key_file_get_string (kf, "Download", "Url", NULL);
+    self->priv->fmt = g_key_file_get_integer (kf, "Download", "Format", NULL);
+    self->priv->resolved = g_key_file_get_int64 (kf, "Download", "Resolved", NULL);
+
+    g_key_file_free (kf);
 
     return DOWNLOAD (self);
 }
@@ -161,31 +248,32 @@ youtube_download_export_to_file (Download *self)
 {
     YoutubeDownloadPrivate *priv = YOUTUBE_DOWNLOAD (self)->priv;
 
-    gint i = strlen (priv->source);
-    while (priv->source[i--] != '=');
+    GString *str = g_string_new ("[Download]\n");
 
-    gchar *str = g_strdup_printf ("%s/gdman/%s.youtube", g_get_user_config_dir (), priv->source+i+2);
-    FILE *fptr = fopen (str, "w");
-    g_free (str);
+    g_string_append_printf (str, "Source=%s\n", priv->source);
+    g_string_append_printf (str, "Destination=%s\n", priv->dest);
+    g_string_append_printf (str, "Size=%" G_GINT64_FORMAT "\n", priv->size);
+    g_string_append_printf (str, "Completed=%" G_GINT64_FORMAT "\n", priv->completed);
 
-    gchar *group = "[Download]\n";
-    fwrite (group, 1, strlen (group), fptr);
+    if (priv->url) {
+        g_string_append_printf (str, "Url=%s\n", priv->url);
+        g_string_append_printf (str, "Format=%d\n", priv->fmt);
+        g_string_append_printf (str, "Resolved=%" G_GINT64_FORMAT "\n", priv->resolved);
+    }
 
-    fwrite ("Source=", 1, 7, fptr);
-    fwrite (priv->source, 1, strlen (priv->source), fptr);
+    state_store_put (state_store_get_default (), priv->key, str->str, str->len);
 
-    fwrite ("\nDestination=", 1, 13, fptr);
-    fwrite (priv->dest, 1, strlen (priv->dest), fptr);
+    g_string_free (str, TRUE);
 
-    str = g_strdup_printf ("\nSize=%d\n", priv->size);
-    fwrite (str, 1, strlen (str), fptr);
-    g_free (str);
+    return TRUE;
+}
 
-    str = g_strdup_printf ("Completed=%d\n", priv->completed);
-    fwrite (str, 1, strlen (str), fptr);
-    g_free (str);
+static gboolean
+youtube_download_forget (Download *self)
+{
+    state_store_remove (state_store_get_default (), YOUTUBE_DOWNLOAD (self)->priv->key);
 
-    fclose (fptr);
+    return TRUE;
 }
 
 gchar*
@@ -205,13 +293,19 @@ youtube_download_get_title (Download *self)
     }
 }
 
-gint
+const gchar*
+youtube_download_get_source (Download *self)
+{
+    return YOUTUBE_DOWNLOAD (self)->priv->source;
+}
+
+goffset
 youtube_download_get_size_total (Download *self)
 {
     return YOUTUBE_DOWNLOAD (self)->priv->size;
 }
 
-gint
+goffset
 youtube_download_get_size_completed (Download *self)
 {
     return YOUTUBE_DOWNLOAD (self)->priv->completed;
@@ -228,8 +322,12 @@ youtube_download_get_time_remaining (Download *self)
 {
     YoutubeDownloadPrivate *priv = YOUTUBE_DOWNLOAD (self)->priv;
 
-    gdouble cr;
-    curl_easy_getinfo (priv->curl, CURLINFO_SPEED_DOWNLOAD, &cr);
+    if (priv->state != DOWNLOAD_STATE_RUNNING) {
+        return -1;
+    }
+
+    // The handle belongs to the engine thread, use the rate it published
+    gint cr = g_atomic_int_get (&priv->rate);
 
     if (cr != 0) {
         return (priv->size - priv->completed) / cr;
@@ -244,12 +342,94 @@ youtube_download_get_state (Download *self)
     return YOUTUBE_DOWNLOAD (self)->priv->state;
 }
 
+static void
+youtube_download_setup (YoutubeDownload *self)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
+
+    if (!priv->curl) {
+        priv->curl = transfer_engine_get_handle (transfer_engine_get_default ());
+    }
+
+    curl_easy_setopt (priv->curl, CURLOPT_NOPROGRESS, 0);
+    curl_easy_setopt (priv->curl, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback) youtube_download_progress);
+    curl_easy_setopt (priv->curl, CURLOPT_PROGRESSDATA, self);
+
+    curl_easy_setopt (priv->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback) youtube_write_data);
+    curl_easy_setopt (priv->curl, CURLOPT_WRITEDATA, self);
+}
+
+static void
+youtube_download_request_info (YoutubeDownload *self)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
+
+    gint i = strlen (priv->source);
+    while (priv->source[i--] != '=');
+
+    gchar *str = g_strdup_printf ("http://www.youtube.com/get_video_info?&video_id=%s", priv->source+i+2);
+    curl_easy_setopt (priv->curl, CURLOPT_URL, str);
+    curl_easy_setopt (priv->curl, CURLOPT_RANGE, NULL);
+    g_free (str);
+
+    priv->stage = YOUTUBE_STAGE_DFIRST;
+    priv->scan = YOUTUBE_SCAN_KEY;
+    g_string_truncate (priv->token, 0);
+
+    transfer_engine_add (transfer_engine_get_default (), priv->curl, G_OBJECT (self),
+        (TransferDoneFunc) youtube_download_info_done, self);
+}
+
 gboolean
 youtube_download_start (Download *self)
 {
     YoutubeDownloadPrivate *priv = YOUTUBE_DOWNLOAD (self)->priv;
 
-    priv->main = g_thread_create ((GThreadFunc) youtube_download_main, YOUTUBE_DOWNLOAD (self), TRUE, NULL);
+    priv->state = DOWNLOAD_STATE_RUNNING;
+    _emit_download_state_changed (self, priv->state);
+
+    // The info request of a resolve underway goes on with the file
+    if (_download_join_resolve (&priv->resolving)) {
+        return TRUE;
+    }
+
+    youtube_download_setup (YOUTUBE_DOWNLOAD (self));
+
+    // A url resolved recently goes straight to the ranged request
+    if (priv->url && time (NULL) - priv->resolved < YOUTUBE_URL_TTL) {
+        priv->cached = TRUE;
+        youtube_download_fetch_file (YOUTUBE_DOWNLOAD (self));
+    } else {
+        youtube_download_request_info (YOUTUBE_DOWNLOAD (self));
+    }
+
+    return TRUE;
+}
+
+static gboolean
+youtube_download_resolve (Download *self)
+{
+    YoutubeDownloadPrivate *priv = YOUTUBE_DOWNLOAD (self)->priv;
+
+    if (priv->state != DOWNLOAD_STATE_QUEUED ||
+        (priv->url && time (NULL) - priv->resolved < YOUTUBE_URL_TTL) ||
+        !_download_begin_resolve (&priv->resolving)) {
+        return FALSE;
+    }
+
+    youtube_download_setup (YOUTUBE_DOWNLOAD (self));
+    youtube_download_request_info (YOUTUBE_DOWNLOAD (self));
+
+    return TRUE;
+}
+
+gboolean
+youtube_download_queue (Download *self)
+{
+    YoutubeDownloadPrivate *priv = YOUTUBE_DOWNLOAD (self)->priv;
+
+    priv->state = DOWNLOAD_STATE_QUEUED;
+    _emit_download_state_changed (self, priv->state);
 }
 
 gboolean
@@ -271,84 +451,131 @@ youtube_download_pause (Download *self)
 
     switch (priv->state) {
         case DOWNLOAD_STATE_RUNNING:
+            // The write callback aborts the transfer on its next chunk
             priv->state = DOWNLOAD_STATE_PAUSED;
-            g_thread_join (priv->main);
+            _emit_download_state_changed (self, priv->state);
             break;
 //        default:
     };
 }
 
+/*
+ * Pick the url of the highest format from the still escaped fmt_url_map
+ * value, a list of <fmt>|<url> pairs.
+ */
 static gchar*
-youtube_parse_dl_link (gchar *data)
+youtube_parse_url_map (const gchar *value, gint *format)
 {
-    gint i, j;
+    gint j;
 
     gint fmt = 0;
     gchar *url = NULL;
 
-    gchar **lines = g_strsplit (data, "&", 0);
-
-    for (i = 0; lines[i]; i++) {
-        if (g_str_has_prefix (lines[i], "fmt_url_map")) {
-            gchar *str = g_uri_unescape_string (lines[i]+12, "");
-            gchar **urlmap = g_strsplit (str, ",", 0);
-            g_free (str);
-
-            for (j = 0; urlmap[j]; j++) {
-                gchar **kv = g_strsplit (urlmap[j], "|", 0);
+    gchar *str = g_uri_unescape_string (value, "");
+    if (!str) {
+        return NULL;
+    }
 
-                gint nfmt = atoi (kv[0]);
-                if (nfmt > fmt) {
-                    if (url) g_free (url);
-                    url = g_uri_unescape_string (kv[1], "");
-                    fmt = nfmt;
-                }
+    gchar **urlmap = g_strsplit (str, ",", 0);
+    g_free (str);
 
-                g_strfreev (kv);
-            }
+    for (j = 0; urlmap[j]; j++) {
+        gchar **kv = g_strsplit (urlmap[j], "|", 2);
 
-            g_strfreev (urlmap);
-            break;
+        gint nfmt = atoi (kv[0]);
+        if (kv[1] && nfmt > fmt) {
+            g_free (url);
+            url = g_uri_unescape_string (kv[1], "");
+            fmt = nfmt;
         }
+
+        g_strfreev (kv);
     }
 
-    g_strfreev (lines);
+    g_strfreev (urlmap);
 
+    *format = fmt;
     return url;
 }
 
+/*
+ * Feed the next bytes of the get_video_info response. Only the value of
+ * fmt_url_map is kept, returns TRUE once all of it went by.
+ */
+static gboolean
+youtube_scan_info (YoutubeDownload *self, const gchar *buff, gsize len)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
+    const gchar *end = buff + len;
+    const gchar *amp;
+
+    while (buff < end && priv->scan != YOUTUBE_SCAN_DONE) {
+        switch (priv->scan) {
+            case YOUTUBE_SCAN_KEY:
+                if (*buff == '=') {
+                    priv->scan = strcmp (priv->token->str, "fmt_url_map") == 0 ?
+                        YOUTUBE_SCAN_MAP : YOUTUBE_SCAN_SKIP;
+                    g_string_truncate (priv->token, 0);
+                } else if (*buff == '&') {
+                    g_string_truncate (priv->token, 0);
+                } else if (priv->token->len < YOUTUBE_MAX_KEY) {
+                    g_string_append_c (priv->token, *buff);
+                }
+                buff++;
+                break;
+            case YOUTUBE_SCAN_SKIP:
+                amp = memchr (buff, '&', end - buff);
+                if (amp) {
+                    priv->scan = YOUTUBE_SCAN_KEY;
+                    buff = amp + 1;
+                } else {
+                    buff = end;
+                }
+                break;
+            case YOUTUBE_SCAN_MAP:
+                amp = memchr (buff, '&', end - buff);
+                g_string_append_len (priv->token, buff, (amp ? amp : end) - buff);
+                if (amp) {
+                    priv->scan = YOUTUBE_SCAN_DONE;
+                }
+                buff = end;
+                break;
+        }
+    }
+
+    return priv->scan == YOUTUBE_SCAN_DONE;
+}
+
 static size_t
 youtube_write_data (char *buff, size_t size, size_t num, YoutubeDownload *self)
 {
-    if (self->priv->state != DOWNLOAD_STATE_RUNNING) {
+    if (self->priv->state != DOWNLOAD_STATE_RUNNING &&
+        g_atomic_int_get (&self->priv->resolving) == DOWNLOAD_RESOLVE_IDLE) {
         return -1;
     }
 
     switch (self->priv->stage) {
         case YOUTUBE_STAGE_DFIRST:
-            if (self->priv->buff == NULL) {
-                gdouble cs;
-                curl_easy_getinfo (self->priv->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &cs);
-
-                self->priv->buff = g_new0 (gchar, (gint) cs);
-                self->priv->buff_pos = 0;
+            if (youtube_scan_info (self, buff, size * num)) {
+                // The rest of the response is of no use
+                return 0;
             }
-
-            memcpy (self->priv->buff+self->priv->buff_pos, buff, size * num);
-            self->priv->buff_pos += size * num;
             break;
         case YOUTUBE_STAGE_DFILE:
-            if (self->priv->size == 0 && self->priv->curl) {
-                gdouble fs;
-                curl_easy_getinfo (self->priv->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &fs);
-                self->priv->size = (gint) fs;
+            if (!rate_limiter_consume (rate_limiter_get_default (), DOWNLOAD (self),
+                    self->priv->curl, size * num)) {
+                return CURL_WRITEFUNC_PAUSE;
             }
 
-            if (!self->priv->fptr) {
-                self->priv->fptr = fopen (self->priv->dest, "w");
+            switch (disk_stream_write (self->priv->out, buff, size * num)) {
+                case DISK_STREAM_FULL:
+                    // The chunk comes again once the writer caught up
+                    rate_limiter_refund (rate_limiter_get_default (), DOWNLOAD (self), size * num);
+                    return CURL_WRITEFUNC_PAUSE;
+                case DISK_STREAM_ERROR:
+                    return -1;
             }
 
-            fwrite (buff, size, num, self->priv->fptr);
             self->priv->completed += num * size;
             break;
         default:
@@ -361,9 +588,19 @@ youtube_write_data (char *buff, size_t size, size_t num, YoutubeDownload *self)
 static int
 youtube_download_progress (YoutubeDownload *self, gdouble dt, gdouble dn, gdouble ut, gdouble un)
 {
+    if (self->priv->state != DOWNLOAD_STATE_RUNNING &&
+        g_atomic_int_get (&self->priv->resolving) == DOWNLOAD_RESOLVE_IDLE) {
+        return -1;
+    }
+
     time_t nt = time (NULL);
 
     if (nt != self->priv->ot) {
+        gdouble rate = 0;
+
+        curl_easy_getinfo (self->priv->curl, CURLINFO_SPEED_DOWNLOAD, &rate);
+        g_atomic_int_set (&self->priv->rate, (gint) MIN (rate, G_MAXINT));
+
         self->priv->ot = nt;
         _emit_download_position_changed (DOWNLOAD (self));
     }
@@ -371,90 +608,402 @@ youtube_download_progress (YoutubeDownload *self, gdouble dt, gdouble dn, gdoubl
     return 0;
 }
 
-gpointer
-youtube_download_main (YoutubeDownload *self)
+static gchar*
+youtube_download_build_dest (YoutubeDownload *self)
 {
-    gint i = strlen (self->priv->source);
-    while (self->priv->source[i--] != '=');
+    YoutubeDownloadPrivate *priv = self->priv;
+    gchar *dest;
 
-    self->priv->curl = curl_easy_init ();
+    if (priv->dest[0] == '/') {
+        dest = g_strdup (priv->dest);
+    } else if (priv->dest[0] == '~') {
+        dest = g_build_filename (g_get_home_dir (), priv->dest+2, NULL);
+    } else {
+        dest = g_build_filename (g_get_tmp_dir (), priv->dest, NULL);
+    }
 
-    gchar *str = g_strdup_printf ("http://www.youtube.com/get_video_info?&video_id=%s", self->priv->source+i+2);
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, str);
-    g_free (str);
+    if (g_file_test (dest, G_FILE_TEST_IS_DIR)) {
+        gint i = strlen (priv->source);
+        while (priv->source[i--] != '=');
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOPROGRESS, 0);
-    curl_easy_setopt (self->priv->curl, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback) youtube_download_progress);
-    curl_easy_setopt (self->priv->curl, CURLOPT_PROGRESSDATA, self);
+        gchar *new_dest = g_strdup_printf ("%s/youtube%s.flv", dest, priv->source+i+2);
+        g_free (dest);
+        dest = new_dest;
+    }
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback) youtube_write_data);
-    curl_easy_setopt (self->priv->curl, CURLOPT_WRITEDATA, YOUTUBE_DOWNLOAD (self));
+    return dest;
+}
 
-    self->priv->stage = YOUTUBE_STAGE_DFIRST;
-    self->priv->state = DOWNLOAD_STATE_RUNNING;
+static size_t
+youtube_header_data (char *buff, size_t size, size_t num, YoutubeDownload *self)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
+    gsize len = size * num;
 
-    curl_easy_perform (self->priv->curl);
+    if (!priv->probing) {
+        return len;
+    }
 
-    str = youtube_parse_dl_link (self->priv->buff);
-    g_free (self->priv->buff);
+    if (len > 5 && g_ascii_strncasecmp (buff, "HTTP/", 5) == 0) {
+        // Every response of a redirect chain starts over
+        priv->length = priv->range_start = priv->range_total = -1;
+    } else if (len > 15 && g_ascii_strncasecmp (buff, "Content-Length:", 15) == 0) {
+        gchar *val = g_strndup (buff + 15, len - 15);
+        priv->length = g_ascii_strtoll (val, NULL, 10);
+        g_free (val);
+    } else if (len > 14 && g_ascii_strncasecmp (buff, "Content-Range:", 14) == 0) {
+        // bytes <start>-<end>/<total>
+        gchar *val = g_strndup (buff + 14, len - 14);
+        gchar *p = strstr (val, "bytes");
+
+        p = p ? p + 5 : val;
+        while (*p == ' ' || *p == '\t') p++;
+
+        if (g_ascii_isdigit (*p)) {
+            priv->range_start = g_ascii_strtoll (p, NULL, 10);
+        }
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, str);
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOBODY, 1);
+        p = strchr (p, '/');
+        if (p && g_ascii_isdigit (p[1])) {
+            priv->range_total = g_ascii_strtoll (p + 1, NULL, 10);
+        }
 
-    curl_easy_perform (self->priv->curl);
+        g_free (val);
+    } else if (buff[0] == '\r' || buff[0] == '\n') {
+        glong code = 0;
+        curl_easy_getinfo (priv->curl, CURLINFO_RESPONSE_CODE, &code);
 
-    gdouble cl;
-    curl_easy_getinfo (self->priv->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &cl);
+        // Interim responses and redirects being followed are skipped
+        if (code / 100 == 1 || code / 100 == 3) {
+            return len;
+        }
 
-    gchar *dest;
-    if (self->priv->dest[0] == '/') {
-        dest = g_strdup (self->priv->dest);
-    } else if (self->priv->dest[0] == '~') {
-        dest = g_build_filename (g_get_home_dir (), self->priv->dest+2);
+        priv->probing = FALSE;
+        if (!youtube_download_begin (self, code)) {
+            return 0;
+        }
+    }
+
+    return len;
+}
+
+static void
+youtube_download_info_done (CURL *curl, CURLcode res, YoutubeDownload *self)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
+
+    gint resolving = g_atomic_int_get (&priv->resolving);
+    gchar *str = NULL;
+    gint fmt = 0;
+
+    // The map is complete once the next field started or the response
+    // ended right after it
+    if ((priv->state == DOWNLOAD_STATE_RUNNING || resolving != DOWNLOAD_RESOLVE_IDLE) &&
+        res != CURLE_ABORTED_BY_CALLBACK &&
+        (priv->scan == YOUTUBE_SCAN_DONE || (priv->scan == YOUTUBE_SCAN_MAP && res == CURLE_OK))) {
+        str = youtube_parse_url_map (priv->token->str, &fmt);
+    }
+
+    priv->scan = YOUTUBE_SCAN_KEY;
+    g_string_truncate (priv->token, 0);
+
+    if (str) {
+        g_free (priv->url);
+        priv->url = str;
+        priv->fmt = fmt;
+        priv->resolved = time (NULL);
+        priv->cached = FALSE;
+    }
+
+    // Only now a start stops joining, the url is in place for it
+    resolving = _download_end_resolve (&priv->resolving);
+
+    if (resolving != DOWNLOAD_RESOLVE_IDLE) {
+        _emit_download_resolved (DOWNLOAD (self), str != NULL);
+    }
+
+    // Without a start joining a resolve ends here
+    if (resolving == DOWNLOAD_RESOLVE_BUSY || priv->state != DOWNLOAD_STATE_RUNNING ||
+        res == CURLE_ABORTED_BY_CALLBACK) {
+        return;
+    }
+
+    if (!str) {
+        priv->state = DOWNLOAD_STATE_STOPPED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return;
+    }
+
+    youtube_download_fetch_file (self);
+}
+
+static void
+youtube_download_fetch_file (YoutubeDownload *self)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
+
+    gchar *dest = youtube_download_build_dest (self);
+
+    // Only the ranges journaled as synced are known to be on disk, the
+    // saved progress may be ahead of them
+    if (priv->size > 0) {
+        priv->journal = range_journal_open (dest, priv->size);
+    }
+
+    priv->completed = priv->journal ? range_journal_contiguous (priv->journal, 0) : 0;
+
+    g_free (dest);
+
+    // The file is requested right away from where the journaled progress
+    // ends, its headers tell whether that could be honoured
+    gchar *range = NULL;
+    if (priv->completed > 0) {
+        range = g_strdup_printf ("%" G_GINT64_FORMAT "-", priv->completed);
+    }
+
+    curl_easy_setopt (priv->curl, CURLOPT_URL, priv->url);
+    curl_easy_setopt (priv->curl, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt (priv->curl, CURLOPT_RANGE, range);
+    curl_easy_setopt (priv->curl, CURLOPT_HEADERFUNCTION, (curl_write_callback) youtube_header_data);
+    curl_easy_setopt (priv->curl, CURLOPT_HEADERDATA, self);
+
+    g_free (range);
+
+    priv->probing = TRUE;
+    priv->restart = FALSE;
+    priv->length = priv->range_start = priv->range_total = -1;
+    priv->stage = YOUTUBE_STAGE_DFILE;
+
+    transfer_engine_add (transfer_engine_get_default (), priv->curl, G_OBJECT (self),
+        (TransferDoneFunc) youtube_download_done, self);
+}
+
+static gboolean
+youtube_download_begin (YoutubeDownload *self, glong code)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
+    RangeJournal *journal = priv->journal;
+    goffset cl = code == 206 || code == 416 ? priv->range_total : priv->length;
+    gint fd;
+
+    // Only a request that asked for a range can be refused or answered
+    // with the wrong one
+    gboolean ranged = priv->completed > 0;
+
+    priv->journal = NULL;
+
+    if ((code == 403 || code == 410) && priv->cached) {
+        // The saved url expired early, resolve it again
+        if (journal) {
+            range_journal_free (journal);
+        }
+
+        priv->resolve = TRUE;
+        return FALSE;
+    }
+
+    gchar *dest = youtube_download_build_dest (self);
+
+    // A journal kept for another length describes an older file
+    if (journal && cl != priv->size) {
+        range_journal_free (journal);
+        journal = NULL;
+    }
+
+    if (!journal && cl > 0) {
+        journal = range_journal_open (dest, cl);
+    }
+
+    // A destination removed or cut short since lost what the journal holds
+    if (journal && !range_journal_fits (journal, dest)) {
+        range_journal_reset (journal);
+        priv->completed = 0;
+    }
+
+    if (cl > 0 && priv->completed == cl) {
+        // Download is completed, the range asked for lies past the end
+        if (journal) {
+            range_journal_discard (journal);
+        }
+
+        g_free (dest);
+        priv->size = cl;
+        priv->state = DOWNLOAD_STATE_COMPLETED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return FALSE;
+    }
+
+    if (ranged && (code == 416 ||
+        (code == 206 && (priv->range_start != priv->completed || cl != priv->size)))) {
+        // The saved progress belongs to another version of the file or is
+        // gone from disk, drop it and start over once this response is dropped
+        if (journal) {
+            range_journal_reset (journal);
+            range_journal_free (journal);
+        }
+
+        g_free (dest);
+        priv->size = 0;
+        priv->completed = 0;
+        priv->restart = TRUE;
+        return FALSE;
+    }
+
+    if (code / 100 != 2) {
+        g_print ("Error fetching %s: HTTP %ld\n", priv->source, code);
+
+        if (journal) {
+            range_journal_free (journal);
+        }
+
+        g_free (dest);
+        priv->state = DOWNLOAD_STATE_STOPPED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return FALSE;
+    }
+
+    if (code == 206 && ranged) {
+        fd = g_open (dest, O_WRONLY, 0644);
     } else {
-        dest = g_build_filename (g_get_tmp_dir (), self->priv->dest);
+        // Either the download is new, the server ignored the range or an
+        // error occured so start over with this response
+        priv->completed = 0;
+        fd = g_open (dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (journal) {
+            range_journal_reset (journal);
+        }
     }
 
-    if (g_file_test (dest, G_FILE_TEST_IS_DIR)) {
-        gint i = strlen (self->priv->source);
-        while (self->priv->source[i--] != '=');
+    priv->size = cl;
 
-        gchar *new_dest = g_strdup_printf ("%s/youtube%s.flv", dest, self->priv->source+i+2);
+    if (fd == -1) {
+        g_print ("Error opening %s\n", dest);
         g_free (dest);
-        dest = new_dest;
+        if (journal) {
+            range_journal_free (journal);
+        }
+
+        priv->state = DOWNLOAD_STATE_STOPPED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+        return FALSE;
     }
 
-    struct stat ostat;
-    g_stat (dest, &ostat);
+    priv->file = disk_file_new (fd);
+    disk_file_set_journal (priv->file, journal);
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_URL, str);
-    g_free (str);
+    if (cl > 0) {
+        disk_file_allocate (priv->file, cl,
+            (DiskFileDoneFunc) youtube_download_allocated, g_object_ref (self));
+    }
 
-    self->priv->size = cl;
-    if (ostat.st_size > 0 && ostat.st_size == self->priv->completed && ostat.st_size < cl) {
-        self->priv->completed = ostat.st_size;
-        curl_easy_setopt (self->priv->curl, CURLOPT_RESUME_FROM, (long) self->priv->completed);
+    g_free (dest);
 
-        self->priv->fptr = fopen (dest, "a");
-    } else if (ostat.st_size == cl) {
-        self->priv->state = DOWNLOAD_STATE_COMPLETED;
+    priv->out = disk_stream_new (priv->file, priv->completed, priv->curl);
+
+    return TRUE;
+}
+
+static void
+youtube_download_done (CURL *curl, CURLcode res, YoutubeDownload *self)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
+
+    if (priv->resolve) {
+        g_free (priv->url);
+        priv->url = NULL;
+        priv->resolve = FALSE;
+
+        if (priv->state == DOWNLOAD_STATE_RUNNING) {
+            youtube_download_start (DOWNLOAD (self));
+        }
         return;
-    } else {
-        self->priv->fptr = fopen (dest, "w");
     }
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOBODY, 0);
-    curl_easy_setopt (self->priv->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback) youtube_write_data);
-    curl_easy_setopt (self->priv->curl, CURLOPT_WRITEDATA, YOUTUBE_DOWNLOAD (self));
+    if (priv->restart) {
+        // A restart during shutdown is left to the next start
+        if (priv->state == DOWNLOAD_STATE_RUNNING &&
+            transfer_engine_is_running (transfer_engine_get_default ())) {
+            youtube_download_start (DOWNLOAD (self));
+            return;
+        }
+
+        transfer_engine_release_handle (transfer_engine_get_default (), curl);
+        priv->curl = NULL;
+        return;
+    }
+
+    if (priv->probing && priv->state == DOWNLOAD_STATE_RUNNING && res != CURLE_ABORTED_BY_CALLBACK) {
+        // The response ended before its headers did
+        g_print ("Error fetching %s: %s\n", priv->source, curl_easy_strerror (res));
+
+        priv->state = DOWNLOAD_STATE_STOPPED;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+    }
+
+    if (priv->journal) {
+        range_journal_free (priv->journal);
+        priv->journal = NULL;
+    }
+
+    if (priv->out) {
+        disk_stream_close (priv->out);
+        priv->out = NULL;
+    }
+
+    transfer_engine_release_handle (transfer_engine_get_default (), priv->curl);
+    priv->curl = NULL;
+
+    if (!priv->file) {
+        return;
+    }
+
+    // The state is only settled once the writer has the data on disk
+    priv->result = res;
+    disk_file_finish (priv->file, res == CURLE_OK,
+        (DiskFileDoneFunc) youtube_download_written, g_object_ref (self));
+
+    disk_file_unref (priv->file);
+    priv->file = NULL;
+}
+
+/*
+ * Called from the writer thread once the file has its space, a download
+ * that cannot get it fails right away instead of part way through.
+ */
+static void
+youtube_download_allocated (gboolean ok, YoutubeDownload *self)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
 
-    curl_easy_setopt (self->priv->curl, CURLOPT_NOPROGRESS, 0);
-    curl_easy_setopt (self->priv->curl, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback) youtube_download_progress);
-    curl_easy_setopt (self->priv->curl, CURLOPT_PROGRESSDATA, self);
+    if (!ok && priv->state == DOWNLOAD_STATE_RUNNING) {
+        priv->state = DOWNLOAD_STATE_ERROR;
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+    }
 
-    self->priv->stage = YOUTUBE_STAGE_DFILE;
+    g_object_unref (self);
+}
 
-    curl_easy_perform (self->priv->curl);
+/*
+ * Called from the writer thread once everything received is written and
+ * synced, or failed to be.
+ */
+static void
+youtube_download_written (gboolean ok, YoutubeDownload *self)
+{
+    YoutubeDownloadPrivate *priv = self->priv;
+    CURLcode res = ok ? priv->result : CURLE_WRITE_ERROR;
+
+    if (priv->state == DOWNLOAD_STATE_RUNNING && priv->result != CURLE_ABORTED_BY_CALLBACK) {
+        if (res == CURLE_OK) {
+            priv->state = DOWNLOAD_STATE_COMPLETED;
+        } else {
+            g_print ("Error fetching %s: %s\n", priv->source, curl_easy_strerror (res));
+            priv->state = ok ? DOWNLOAD_STATE_STOPPED : DOWNLOAD_STATE_ERROR;
+        }
+
+        _emit_download_state_changed (DOWNLOAD (self), priv->state);
+    }
 
-    self->priv->state = DOWNLOAD_STATE_COMPLETED;
-    _emit_download_state_changed (DOWNLOAD (self), self->priv->state);
+    g_object_unref (self);
 }
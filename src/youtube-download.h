@@ -25,6 +25,7 @@
 #include <glib-object.h>
 
 #include "download.h"
+#include "download-registry.h"
 
 #define YOUTUBE_DOWNLOAD_TYPE (youtube_download_get_type ())
 #define YOUTUBE_DOWNLOAD(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), YOUTUBE_DOWNLOAD_TYPE, YoutubeDownload))
@@ -33,6 +34,9 @@
 #define IS_YOUTUBE_DOWNLOAD_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), YOUTUBE_DOWNLOAD_TYPE))
 #define YOUTUBE_DOWNLOAD_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), YOUTUBE_DOWNLOAD_TYPE, YoutubeDownloadClass))
 
+// Saved state is keyed <id>.youtube
+#define YOUTUBE_DOWNLOAD_TAG "youtube"
+
 G_BEGIN_DECLS
 
 typedef struct _YoutubeDownload YoutubeDownload;
@@ -50,7 +54,8 @@ struct _YoutubeDownloadClass {
 };
 
 Download *youtube_download_new (const gchar *source, const gchar *dest);
-Download *youtube_download_new_from_file (const gchar *filename);
+Download *youtube_download_new_from_data (const gchar *key, const gchar *data, gsize len);
+void youtube_download_register (DownloadRegistry *registry);
 
 GType youtube_download_get_type (void);
 